@@ -0,0 +1,227 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <filesystem>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "../nlohmann/json.hpp"
+#include "options.hpp"
+#include "synthetic.hpp"
+
+using ordered_json = nlohmann::ordered_json;
+
+// End-to-end training benchmark: generates synthetic inputs, runs the trainer
+// for every engine, size and thread count and reports timings, peak memory and
+// whether the merge list matches the first run of the same engine and input.
+// Engines are not compared with each other: they may break ties between pairs
+// of the same count differently (lowmem by the smaller pair, fast by the order
+// the pairs were first seen), so only runs of one engine must agree.
+
+struct Engine {
+    std::string name;
+    std::vector<std::string> args; // extra arguments after the positional ones
+};
+
+struct RunResult {
+    int exit_code = 0;
+    size_t wall_ms = 0;
+    size_t peak_rss_kb = 0;
+};
+
+std::vector<size_t> parse_list(const std::string& value) {
+    std::vector<size_t> result;
+    std::stringstream values(value);
+    std::string item;
+    while (std::getline(values, item, ',')) {
+        result.push_back(std::stoul(item));
+    }
+    return result;
+}
+
+// "name" or "name:--flag value ..."
+Engine parse_engine(const std::string& value) {
+    Engine engine;
+    size_t colon = value.find(':');
+    engine.name = value.substr(0, colon);
+    if (colon != std::string::npos) {
+        std::stringstream args(value.substr(colon + 1));
+        std::string arg;
+        while (args >> arg) {
+            engine.args.push_back(arg);
+        }
+    }
+    return engine;
+}
+
+RunResult run_command(const std::vector<std::string>& command, const std::string& log_file) {
+    RunResult result;
+    auto start = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid == 0) {
+        int fd = open(log_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        dup2(fd, 1);
+        dup2(fd, 2);
+        close(fd);
+        std::vector<char*> argv;
+        for (const auto& arg : command) {
+            argv.push_back(const_cast<char*>(arg.c_str()));
+        }
+        argv.push_back(nullptr);
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+    int status = 0;
+    struct rusage usage;
+    wait4(pid, &status, 0, &usage);
+    result.wall_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    result.peak_rss_kb = usage.ru_maxrss;
+    result.exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    return result;
+}
+
+// value from a "<prefix>... took <number> ms" line of the trainer log
+long get_log_ms(const std::string& log_file, const std::string& prefix) {
+    std::ifstream log(log_file);
+    std::string line;
+    while (std::getline(log, line)) {
+        size_t took = line.find(" took ");
+        if (line.rfind(prefix, 0) == 0 && took != std::string::npos) {
+            return std::stol(line.substr(took + 6));
+        }
+    }
+    return -1;
+}
+
+// merged pairs in order, from the third column of the .poses file
+std::vector<std::string> get_merges(const std::string& output_prefix) {
+    std::vector<std::string> merges;
+    std::filesystem::path prefix(output_prefix);
+    std::string name = prefix.filename().string() + ".";
+    for (const auto& entry : std::filesystem::directory_iterator(prefix.parent_path())) {
+        std::string file_name = entry.path().filename().string();
+        if (file_name.rfind(name, 0) != 0 || entry.path().extension() != ".poses") {
+            continue;
+        }
+        std::ifstream poses(entry.path());
+        std::string line;
+        while (std::getline(poses, line)) {
+            std::stringstream fields(line);
+            std::string token, kmer, pair;
+            fields >> token >> kmer >> pair;
+            merges.push_back(pair);
+        }
+    }
+    return merges;
+}
+
+int main(int argc, char* argv[]) {
+
+    std::string binary = "bin/bpe.exe";
+    std::string work_dir = "bench_work";
+    std::string output_file = "bench_output.json";
+    std::vector<size_t> sizes = {100000, 1000000};
+    std::vector<size_t> thread_counts = {1, 2, 4};
+    std::vector<Engine> engines;
+    size_t max_tokens = 1024;
+    SyntheticParams params;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--bin") {
+            binary = get_option_value(argc, argv, i);
+        } else if (arg == "--workdir") {
+            work_dir = get_option_value(argc, argv, i);
+        } else if (arg == "--out") {
+            output_file = get_option_value(argc, argv, i);
+        } else if (arg == "--sizes") {
+            sizes = parse_list(get_option_value(argc, argv, i));
+        } else if (arg == "--threads") {
+            thread_counts = parse_list(get_option_value(argc, argv, i));
+        } else if (arg == "--engine") {
+            engines.push_back(parse_engine(get_option_value(argc, argv, i)));
+        } else if (arg == "--max-tokens") {
+            max_tokens = std::stoul(get_option_value(argc, argv, i));
+        } else if (arg == "--mode") {
+            params.mode = get_option_value(argc, argv, i);
+        } else if (arg == "--seed") {
+            params.seed = std::stoull(get_option_value(argc, argv, i));
+        } else {
+            std::cerr << "Unknown option " << arg << std::endl;
+            std::cerr << "Usage: " << argv[0] << " [--bin bin/bpe.exe] [--workdir dir] [--out file.json] [--sizes n,n] [--threads n,n] [--engine name[:args]]... [--max-tokens n] [--mode chromosome|reads] [--seed n]" << std::endl;
+            return 1;
+        }
+    }
+    if (engines.empty()) {
+        engines.push_back(parse_engine("fast"));
+        engines.push_back(parse_engine("lowmem:--engine lowmem"));
+    }
+    std::filesystem::create_directories(work_dir);
+
+    ordered_json results = ordered_json::array();
+    bool all_match = true;
+    for (size_t size : sizes) {
+        params.size = size;
+        std::string input_file = work_dir + "/synthetic." + std::to_string(size) + ".txt";
+        SyntheticGenome(params).write(input_file);
+        std::string format = params.mode == "reads" ? "reads" : "fasta";
+
+        for (const auto& engine : engines) {
+            std::vector<std::string> reference;
+            bool has_reference = false;
+            for (size_t threads : thread_counts) {
+                std::string run_name = engine.name + "." + std::to_string(size) + "." + std::to_string(threads);
+                std::string run_dir = work_dir + "/" + run_name;
+                std::filesystem::remove_all(run_dir);
+                std::filesystem::create_directories(run_dir);
+                std::string output_prefix = run_dir + "/out";
+                std::string log_file = run_dir + "/log.txt";
+
+                std::vector<std::string> command = {binary, input_file, output_prefix, format, std::to_string(max_tokens), std::to_string(threads)};
+                command.insert(command.end(), engine.args.begin(), engine.args.end());
+                std::cerr << "Running " << run_name << std::endl;
+                RunResult run = run_command(command, log_file);
+
+                std::vector<std::string> merges = get_merges(output_prefix);
+                if (!has_reference) {
+                    reference = merges;
+                    has_reference = true;
+                }
+                bool match = run.exit_code == 0 && merges == reference;
+                all_match = all_match && match;
+
+                long init_ms = get_log_ms(log_file, "Filling to ");
+                long merge_ms = get_log_ms(log_file, "Merging took ");
+                long save_ms = get_log_ms(log_file, "Saving took ");
+                double merges_per_sec = merge_ms > 0 ? 1000.0 * merges.size() / merge_ms : 0.0;
+
+                results.push_back({
+                    {"engine", engine.name},
+                    {"size", size},
+                    {"threads", threads},
+                    {"exit_code", run.exit_code},
+                    {"merges", merges.size()},
+                    {"wall_ms", run.wall_ms},
+                    {"init_ms", init_ms},
+                    {"merge_ms", merge_ms},
+                    {"save_ms", save_ms},
+                    {"merges_per_sec", merges_per_sec},
+                    {"peak_rss_kb", run.peak_rss_kb},
+                    {"merges_match_reference", match}
+                });
+                std::cout << results.back().dump() << std::endl;
+            }
+        }
+    }
+
+    std::ofstream out(output_file);
+    out << std::setw(2) << results << std::endl;
+    out.close();
+    std::cerr << "Saved " << output_file << std::endl;
+    return all_match ? 0 : 2;
+}
@@ -6,6 +6,7 @@
 #include <set>
 #include <unordered_map>
 #include <chrono>
+#include <stdexcept>
 
 #include "tokens_model.hpp"
 #include "readers.hpp"
@@ -14,34 +15,83 @@
 #include "core.hpp"
 #include "output.hpp"
 #include "container.hpp"
+#include "options.hpp"
+#include "metrics.hpp"
+#include "trainer.hpp"
+#include "lowmem.hpp"
+#include "hybrid.hpp"
+#include "shards.hpp"
+#include "strand.hpp"
 #include <filesystem> // Include this at the top of your file
 
 
-std::vector<TokenType> get_data(std::string& file_name, std::string& format, const std::unordered_map<std::string, TokenType>& alphabet) {
-    
-    std::vector<std::string> seqs;
-
-    std::cout << "Read data" << std::endl;
+template<typename Records>
+void read_records(std::string& file_name, std::string& format, Records& seqs, bool keep_case) {
     if (format == "reads") {
-        get_sequences_reads(file_name, seqs);
+        get_sequences_reads(file_name, seqs, keep_case);
     } else if (format == "trf") {
         get_sequences_trf(file_name, seqs);
     } else if (format == "fasta") {
-        get_sequences_fasta(file_name, seqs);
+        get_sequences_fasta(file_name, seqs, keep_case);
     } else if (format == "fastq") {
         get_sequences_fastq(file_name, seqs);
     } else {
         std::cout << "Format must be either reads or fasta or trf" << std::endl;
         exit(1);
     }
+}
+
+// with unique_records the duplicates are dropped while reading, with
+// masked_bases soft-masked bases are masked out (get_dataset)
+std::vector<TokenType> get_data(std::string& file_name, std::string& format, const std::unordered_map<std::string, TokenType>& alphabet, UniqueRecords* unique_records, std::string* masked_bases) {
+    
+    std::vector<std::string> seqs;
+
+    std::cout << "Read data" << std::endl;
+    bool keep_case = masked_bases != nullptr;
+    if (unique_records != nullptr) {
+        read_records(file_name, format, *unique_records, keep_case);
+        seqs = unique_records->take_sequences();
+    } else {
+        read_records(file_name, format, seqs, keep_case);
+    }
     std::cout << "Get dataset" << std::endl;
-    return get_dataset(seqs, alphabet);
+    std::vector<TokenType> seq = get_dataset(seqs, alphabet, masked_bases);
+    if (masked_bases != nullptr) {
+        std::cout << "Masked " << masked_bases->size() << " soft-masked bases out of " << seq.size() << " tokens" << std::endl;
+    }
+    return seq;
+}
+
+// Fills the engine, runs the merges and returns the final encoding of the
+// sequence the engine was given; saving starts with it.
+template<typename Engine, typename... Args>
+std::vector<TokenType> run_engine(const std::string& engine_name, std::vector<TokenType>& seq, size_t n_threads, size_t max_tokens, Vocabulary& vocab, MetricsLog& metrics, std::chrono::high_resolution_clock::time_point& save_start_time, Args... engine_args) {
+    // engine errors (e.g. a lost shard worker) are thrown so that the engine
+    // shuts down in its destructor before we exit
+    try {
+        auto start_time = std::chrono::high_resolution_clock::now();
+        std::cout << "Filling to " << engine_name << std::endl;
+        Engine engine(seq, n_threads, engine_args...);
+        auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - start_time).count();
+        std::cout << "Filling to " << engine_name << " took " << duration << " ms" << std::endl;
+        metrics.event("init", duration, engine.size());
+
+        train(engine, vocab, max_tokens, metrics);
+
+        save_start_time = std::chrono::high_resolution_clock::now();
+        return engine.get_as_vector();
+    } catch (const std::runtime_error& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        exit(1);
+    }
 }
 
 int main(int argc, char* argv[]) {
 
-    if (argc != 6) {
-        std::cerr << "Usage: " << argv[0] << " <input_file> <output_file_prefix> <format: reads, fasta, trf, fastq, bpe> <max_tokens> <threads>" << std::endl;
+    if (argc < 6) {
+        std::cerr << "Usage: " << argv[0] << " <input_file> <output_file_prefix> <format: reads, fasta, trf, fastq, bpe> <max_tokens> <threads> [options]" << std::endl;
+        std::cerr << options_usage;
         return 1;
     }
 
@@ -51,15 +101,7 @@ int main(int argc, char* argv[]) {
     size_t max_tokens = std::stoul(argv[4]);
     size_t n_threads = std::stoul(argv[5]);
     std::string n_tokens_suffix = argv[4];
-    const std::set<size_t> snapshot_points = {
-        // 512,
-        // 1024,
-        // 2048,
-        // 4096,
-        // 8192,
-        // 16384,
-        // 32768,
-    };
+    Options options = parse_options(argc, argv, 6);
 
     if (max_tokens > MAX_N_TOKENS) {
         std::cout << "Max tokens must be less than " << MAX_N_TOKENS << std::endl;
@@ -71,122 +113,124 @@ int main(int argc, char* argv[]) {
         return 1;
     }
     
-    std::vector<TokenType> seq = get_data(file_name, format, alphabet);
-
-    // we keep kmer only in merged, in other places we use kmer_id
-    std::vector<Kmer> merged;
-    std::unordered_map<Kmer, size_t, TupleHash> kmer2kmer_id;
-    std::unordered_map<size_t, Kmer> kmer_id2kmer;
-    // set zero for start to mark collapsed nodes
-    kmer2kmer_id[std::make_tuple(0, 0)] = 0;
-    kmer_id2kmer[0] = std::make_tuple(0, 0);
-
-    TokenType L = alphabet.size();
-
-    std::unordered_map<TokenType, size_t> tokens;
-    std::unordered_map<size_t, TokenType> rev_tokens;
-
-    std::unordered_map<TokenType, size_t> token_to_length;
-
-    std::vector<std::thread> threads;
+    MetricsLog metrics;
+    if (!options.metrics_file.empty()) {
+        metrics.open(options.metrics_file, options.metrics_every);
+    }
 
-    std::unordered_map<TokenType, std::string> alphabet_map;
-    std::unordered_map<TokenType, size_t> alphabet_tf_map;
-    // fill with alphabet
-    for (const auto& element : alphabet) {
-        alphabet_map[element.second] = element.first;
-        alphabet_tf_map[element.second] = 0;
+    if (!options.ooc_dir.empty()) {
+        if (!std::filesystem::is_directory(options.ooc_dir)) {
+            std::cout << "Directory " << options.ooc_dir << " does not exist" << std::endl;
+            return 1;
+        }
+        enable_out_of_core(options.ooc_dir, options.ram_budget_mb * 1024);
+    } else if (options.ram_budget_mb) {
+        std::cout << "Option --ram-budget requires --ooc-dir" << std::endl;
+        return 1;
     }
 
-    // precompute
-    auto start_time = std::chrono::high_resolution_clock::now();
-    std::cout << "Filling to SequenceContainer" << std::endl;    
-    SequenceContainer container(seq, kmer2kmer_id, kmer_id2kmer, n_threads);
-    auto end_time = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time).count();
-    std::cout << "Filling to SequenceContainer took " << duration << " ms" << std::endl;
+    if ((options.workers > 1 || options.local_shards > 1) && options.engine == "hybrid") {
+        std::cout << "Options --workers and --local-shards support the fast and lowmem engines" << std::endl;
+        return 1;
+    }
+    if (options.workers > 1 && options.local_shards > 1) {
+        std::cout << "Options --workers and --local-shards cannot be combined" << std::endl;
+        return 1;
+    }
+    if (options.strand_canonical && (options.engine == "hybrid" || options.workers > 1 || options.local_shards > 1)) {
+        std::cout << "Option --strand-canonical supports the fast and lowmem engines without --workers and --local-shards" << std::endl;
+        return 1;
+    }
+    if (options.dedup && (options.engine != "fast" || options.workers > 1 || options.local_shards > 1)) {
+        std::cout << "Option --dedup supports the fast engine without --workers and --local-shards" << std::endl;
+        return 1;
+    }
 
-    seq.clear(); seq.resize(0);
+    UniqueRecords unique_records;
+    std::string masked_bases;
+    std::vector<TokenType> seq = get_data(file_name, format, alphabet, options.dedup ? &unique_records : nullptr, options.softmask ? &masked_bases : nullptr);
+    HelperRuns helper_runs = compact_helper_runs(seq);
+    std::vector<CounterType> weights;
+    if (options.dedup) {
+        weights = get_token_weights(seq, unique_records);
+    }
 
-    int pos = 0;
-    std::string status;
-    size_t rep;
-    size_t tf;
-    
-    while (true) {
+    Vocabulary vocab(alphabet);
+    std::vector<TokenType> raw_seq;
+    auto save_start_time = std::chrono::high_resolution_clock::now();
+    if (options.workers > 1) {
+        raw_seq = run_engine<ShardedEngine>("ShardedEngine", seq, n_threads, max_tokens, vocab, metrics, save_start_time, options.workers, options.engine);
+    } else if (options.local_shards > 1 && options.engine == "lowmem") {
+        raw_seq = run_engine<LocalShardedEngine<LowMemEngine>>("LocalShardedEngine", seq, n_threads, max_tokens, vocab, metrics, save_start_time, options.local_shards);
+    } else if (options.local_shards > 1) {
+        raw_seq = run_engine<LocalShardedEngine<FastEngine>>("LocalShardedEngine", seq, n_threads, max_tokens, vocab, metrics, save_start_time, options.local_shards);
+    } else if (options.strand_canonical && options.engine == "lowmem") {
+        raw_seq = run_engine<StrandCanonicalEngine<LowMemEngine>>("StrandCanonicalEngine", seq, n_threads, max_tokens, vocab, metrics, save_start_time, max_tokens);
+    } else if (options.strand_canonical) {
+        raw_seq = run_engine<StrandCanonicalEngine<FastEngine>>("StrandCanonicalEngine", seq, n_threads, max_tokens, vocab, metrics, save_start_time, max_tokens, (size_t)0, options.dedup ? &weights : nullptr);
+    } else if (options.engine == "lowmem") {
+        raw_seq = run_engine<LowMemEngine>("LowMemEngine", seq, n_threads, max_tokens, vocab, metrics, save_start_time);
+    } else if (options.engine == "hybrid") {
+        raw_seq = run_engine<HybridEngine>("HybridEngine", seq, n_threads, max_tokens, vocab, metrics, save_start_time, options.switch_tf, helper_runs.n_removed);
+    } else {
+        raw_seq = run_engine<FastEngine>("SequenceContainer", seq, n_threads, max_tokens, vocab, metrics, save_start_time, (size_t)0, options.dedup ? &weights : nullptr);
+    }
+    weights.clear(); weights.shrink_to_fit();
+    expand_helper_runs(raw_seq, helper_runs);
+    unmask_bases(raw_seq, masked_bases, alphabet);
+    if (options.dedup) {
+        raw_seq = expand_records(raw_seq, unique_records);
+    }
+    TokenType L = vocab.L;
+    TokenType first_token = vocab.first_token;
+    std::vector<Kmer>& merged = vocab.merged;
+    TokenStrings token_strings;
+    vocab.get_strings(token_strings);
 
-        // std::cout << "Priority queue: ";
-        // container.print_queue(alphabet_map, kmer_id2kmer);
-        // container.display(alphabet_map, kmer_id2kmer);
+    save_bpe_from_vector(raw_seq, token_strings, output_prefix + "." + std::to_string(L) + ".bpe", output_prefix + "." + std::to_string(L) + ".raw.bpe");
 
+    save_snapshot(merged, first_token, raw_seq, token_strings, vocab.alphabet_tf_map, output_prefix, std::to_string(L), true);
 
-        std::tie(rep, tf) = container.get_most_frequent_pair();
+    if (options.npy) {
+        save_npy_encoding(raw_seq, L, output_prefix, std::to_string(L));
+    }
+    if (options.shards) {
+        save_sharded_encoding(raw_seq, L, output_prefix, std::to_string(L), options.shards, n_threads);
+    }
 
-        if (tf < 2) {
-            break;
+    // snapshots are derived from the final encoding, from the largest vocabulary
+    // to the smallest, each one from the previous by splitting the newer tokens
+    std::vector<TokenType> snapshot_seq;
+    std::vector<TokenType> rc_tokens;
+    if (options.strand_canonical) {
+        rc_tokens = get_vocab_rc(vocab);
+    }
+    for (auto it = options.snapshots.rbegin(); it != options.snapshots.rend(); ++it) {
+        TokenType vocab_size = *it;
+        if (vocab_size >= L || vocab_size < first_token) {
+            std::cout << "Skip snapshot " << vocab_size << ": vocabulary has " << L << " tokens" << std::endl;
+            continue;
         }
-        if (max_tokens && L > max_tokens) {
-            break;
+        // a token and its reverse complement stay in the same snapshots
+        if (!rc_tokens.empty() && vocab_size > first_token && rc_tokens[vocab_size - 1] == vocab_size) {
+            vocab_size--;
+            std::cout << "Snapshot " << *it << " would keep a token without its reverse complement, saving " << vocab_size << " instead" << std::endl;
         }
-        if (L >= MAX_N_TOKENS) {
-            break;
+        std::cout << "Saving snapshot " << vocab_size << std::endl;
+        snapshot_seq = decompose_to_vocab(snapshot_seq.empty() ? raw_seq : snapshot_seq, merged, first_token, vocab_size);
+        std::vector<Kmer> snapshot_merged(merged.begin(), merged.begin() + (vocab_size - first_token));
+        std::string suffix = std::to_string(vocab_size);
+        save_snapshot(snapshot_merged, first_token, snapshot_seq, token_strings, vocab.alphabet_tf_map, output_prefix, suffix, false);
+        save_bpe_from_vector(snapshot_seq, token_strings, output_prefix + "." + suffix + ".bpe", output_prefix + "." + suffix + ".raw.bpe");
+        if (options.npy) {
+            save_npy_encoding(snapshot_seq, vocab_size, output_prefix, suffix);
         }
-        
-        // std::cin >> status;
-        
-        //// Fill resulting structures
-        Kmer rep_kmer = kmer_id2kmer.at(rep);
-        merged.push_back(rep_kmer);
-        tokens[L] = rep;
-        rev_tokens[rep] = L;
-        TokenType a = std::get<0>(rep_kmer);
-        TokenType b = std::get<1>(rep_kmer);
-        std::string token_str = alphabet_map.at(a) + alphabet_map.at(b);
-        alphabet_map[L] = token_str;
-        alphabet_tf_map[L] = tf;
-        token_to_length[L] = alphabet_map[L].size();
-
-        if (L < 1000 || (L < 50000 && L % 1000 == 0) || (L < 100000 && L % 10000 == 0) || (L < 1000000 && L % 100000 == 0) || (L < 10000000 && L % 1000000 == 0) || (L < 100000000 && L % 10000000 == 0) || (L % 100000000 == 0)) {
-            
-            end_time = std::chrono::high_resolution_clock::now();
-            auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time).count();
-
-            std::cout << "Tokens " << L << " " << alphabet_map.at(std::get<0>(rep_kmer)) << " " << alphabet_map.at(std::get<1>(rep_kmer)) << " " << token_str << " " << tf << " : "<< "size: " << container.size() << " execution time: " << duration << " milliseconds" << std::endl;
-            pos++;
-            start_time = std::chrono::high_resolution_clock::now();
-        } 
-
-        // container.print_bpe_to_stdout(alphabet_map, kmer_id2kmer);
-        container.collapse(rep, L, kmer2kmer_id, kmer_id2kmer, alphabet_map);
-        // container.print_bpe_to_stdout(alphabet_map, kmer_id2kmer);
-        
-
-        L += 1;
-
-        // std::cout << " new size: " << seq.size() << std::endl;
-
-        // if (snapshot_points.find(L) != snapshot_points.end()) {
-        //     save_snapshot(tokens, merged, kmer2kmer_id, rev_tokens, seq, alphabet_map, alphabet_tf_map, output_prefix, std::to_string(L), false);
-        // }
-
-        
-
-        // container.print_counter(alphabet_map);
-
-        // std::cout << "Continue?";
-        // std::cin >> status;
     }
 
-
-    std::vector<TokenType> raw_seq = container.get_as_vector(kmer_id2kmer);
-    
-    save_snapshot(tokens, merged, kmer2kmer_id, rev_tokens, raw_seq, alphabet_map, alphabet_tf_map, output_prefix, std::to_string(L), true);
-    
-    // container.diagnostic_print_of_state();
-
-    std::string output_bpe_encoding_file = output_prefix + "." + std::to_string(L) + ".bpe";
-    std::string output_bpe_raw_encoding_file = output_prefix + "." + std::to_string(L) + ".raw.bpe";
-    container.save_bpe_to_file(output_bpe_encoding_file, output_bpe_raw_encoding_file, alphabet_map, kmer_id2kmer);
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - save_start_time).count();
+    std::cout << "Saving took " << duration << " ms" << std::endl;
+    metrics.event("save", duration, raw_seq.size());
+    metrics.close();
 
     std::cout << "Saving DONE" << std::endl;
     return 0;
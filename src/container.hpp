@@ -11,11 +11,13 @@
 #include <chrono>
 #include <queue>
 #include <thread>
+#include <functional>
 #include <mutex>
 #include <fstream>
 
 #include "tokens.hpp"
 #include "subcontainers.hpp"
+#include "mapped.hpp"
 
 std::mutex cout_mutex;
 std::mutex hash_mutex;
@@ -23,6 +25,14 @@ std::mutex hash_mutex;
 std::mutex maps_mutex;
 std::string input;
 
+// cumulative counters of the work done by collapse and get_most_frequent_pair
+struct ContainerStats {
+    size_t positions_visited = 0;
+    size_t positions_live = 0;
+    size_t new_kmers = 0;
+    size_t stale_heap_pops = 0;
+};
+
 class SequenceContainer {
 public:
 
@@ -37,18 +47,21 @@ public:
     // Copy constructor
     SequenceContainer(const SequenceContainer& other) {
         container_size_ = other.container_size_;
+        positions_capacity_ = other.positions_capacity_;
         size_ = other.size_;
         counter = other.counter;
         merge_count = other.merge_count;
         max_heap = other.max_heap;
+        stats_ = other.stats_;
+        weights_ = other.weights_;
 
-        array_of_tokens = new size_t[container_size_];
+        array_of_tokens = allocate_array<size_t>(container_size_);
         memcpy(array_of_tokens, other.array_of_tokens, container_size_ * sizeof(size_t));
 
-        array_of_prevs = new size_t[container_size_];
+        array_of_prevs = allocate_array<size_t>(container_size_);
         memcpy(array_of_prevs, other.array_of_prevs, container_size_ * sizeof(size_t));
 
-        array_of_nexts = new size_t[container_size_];
+        array_of_nexts = allocate_array<size_t>(container_size_ + 2);
         memcpy(array_of_nexts, other.array_of_nexts, container_size_ * sizeof(size_t));
     }
 
@@ -56,69 +69,125 @@ public:
     SequenceContainer& operator=(const SequenceContainer& other) {
         if (this != &other) {
             container_size_ = other.container_size_;
+            positions_capacity_ = other.positions_capacity_;
             size_ = other.size_;
             counter = other.counter;
             merge_count = other.merge_count;
             max_heap = other.max_heap;
+            stats_ = other.stats_;
+            weights_ = other.weights_;
 
-            if (array_of_tokens != nullptr) delete[] array_of_tokens;
-            array_of_tokens = new size_t[container_size_];
+            free_array(array_of_tokens);
+            array_of_tokens = allocate_array<size_t>(container_size_);
             memcpy(array_of_tokens, other.array_of_tokens, container_size_ * sizeof(size_t));
 
-            if (array_of_prevs != nullptr) delete[] array_of_prevs;
-            array_of_prevs = new size_t[container_size_];
+            free_array(array_of_prevs);
+            array_of_prevs = allocate_array<size_t>(container_size_);
             memcpy(array_of_prevs, other.array_of_prevs, container_size_ * sizeof(size_t));
 
-            if (array_of_nexts != nullptr) delete[] array_of_nexts;
-            array_of_nexts = new size_t[container_size_];
+            free_array(array_of_nexts);
+            array_of_nexts = allocate_array<size_t>(container_size_ + 2);
             memcpy(array_of_nexts, other.array_of_nexts, container_size_ * sizeof(size_t));
         }
         return *this;
     } 
 
-    void init_in_thread(size_t thread_id, size_t start, size_t end, const std::vector<TokenType>& seq,
-                        std::unordered_map<Kmer, size_t, TupleHash>& kmer2kmer_id,
-                        std::unordered_map<size_t, Kmer>& kmer_id2kmer) {
+    // Multi-threaded fill that gives the same container as init_in_single_thread:
+    // threads first collect the pairs of their chunks in order of first
+    // occurrence, ids are then handed out chunk by chunk, which is the order a
+    // single left to right pass sees them in. Position lists are allocated for
+    // the exact counts before the threads fill them, and sorted afterwards.
+    void init_in_threads(const std::vector<TokenType>& seq,
+                            KmerIndex& kmer2kmer_id,
+                            std::vector<Kmer>& kmer_id2kmer, size_t num_threads) {
         
-        for (size_t i = start; i < end; i++) {
-
-            if (i == container_size_) {
-                break;
+        size_t n_pairs = container_size_ - 1;
+        num_threads = std::max((size_t)1, std::min(num_threads, n_pairs));
+        size_t chunk_size = n_pairs / num_threads;
+        auto run_in_threads = [&](const std::function<void(size_t, size_t, size_t)>& worker) {
+            std::vector<std::thread> threads;
+            for (size_t t = 0; t < num_threads; t++) {
+                size_t start = t * chunk_size;
+                size_t end = t == num_threads - 1 ? n_pairs : start + chunk_size;
+                threads.emplace_back(worker, t, start, end);
             }
-
-            if (i && i % 10000000 == 0) {
-                // protect with maps_mutex
-                std::lock_guard<std::mutex> lock(maps_mutex);
-                std::cout << "Processed " << 100 * i / container_size_ << "%% tokens from " << container_size_ << " in " << thread_id <<  std::endl;
+            for (auto& t : threads) {
+                t.join();
+            }
+        };
+
+        // pairs of each chunk in order of first occurrence, with their counts
+        std::vector<std::vector<Kmer>> chunk_kmers(num_threads);
+        std::vector<std::vector<size_t>> chunk_counts(num_threads);
+        run_in_threads([&](size_t t, size_t start, size_t end) {
+            KmerIndex index;
+            for (size_t i = start; i < end; i++) {
+                Kmer pair = std::make_tuple(seq[i], seq[i + 1]);
+                size_t k = index.insert(pair);
+                if (k == chunk_kmers[t].size()) {
+                    chunk_kmers[t].push_back(pair);
+                    chunk_counts[t].push_back(0);
+                }
+                chunk_counts[t][k]++;
+            }
+        });
+
+        std::vector<size_t> total_counts(kmer2kmer_id.size(), 0);
+        for (size_t t = 0; t < num_threads; t++) {
+            for (size_t k = 0; k < chunk_kmers[t].size(); k++) {
+                const Kmer& pair = chunk_kmers[t][k];
+                size_t kmer_id = kmer2kmer_id.insert(pair);
+                if (kmer_id == kmer_id2kmer.size()) {
+                    kmer_id2kmer.push_back(pair);
+                    total_counts.push_back(0);
+                }
+                total_counts[kmer_id] += chunk_counts[t][k];
             }
-
-            process_item(i, seq, kmer2kmer_id, kmer_id2kmer);
         }
-    }
+        chunk_kmers.clear();
+        chunk_counts.clear();
 
-    void init_in_threads(const std::vector<TokenType>& seq,
-                            std::unordered_map<Kmer, size_t, TupleHash>& kmer2kmer_id,
-                            std::unordered_map<size_t, Kmer>& kmer_id2kmer, size_t num_threads) {
-        
-        size_t chunk_size = container_size_ / num_threads;
-        counter.init_positions(0, 0);
         counter.set_token(0, 1);
-        std::vector<std::thread> threads;
-        for (size_t i = 0; i < num_threads; i++) {
-            size_t start = i * chunk_size;
-            size_t end = (i + 1) * chunk_size;
-
-            if (i == num_threads - 1) {
-                end = container_size_;
+        std::vector<char> help_tokens(total_counts.size(), 1);
+        for (size_t kmer_id = 1; kmer_id < total_counts.size(); kmer_id++) {
+            const Kmer& pair = kmer_id2kmer[kmer_id];
+            help_tokens[kmer_id] = std::get<0>(pair) <= N_HELP_TOKENS || std::get<1>(pair) <= N_HELP_TOKENS;
+            if (!help_tokens[kmer_id]) {
+                counter.init_positions(kmer_id, std::max(total_counts[kmer_id], positions_capacity_));
             }
-             threads.emplace_back([&, i, start, end, seq = std::cref(seq), kmer2kmer_id = std::ref(kmer2kmer_id), kmer_id2kmer = std::ref(kmer_id2kmer)] {
-                    init_in_thread(i, start, end, seq, kmer2kmer_id, kmer_id2kmer);
-            });
+            counter.set_token(kmer_id, help_tokens[kmer_id]);
         }
 
-        for (auto& t : threads) {
-            t.join();
-        }
+        // the maps are only read from here on
+        run_in_threads([&](size_t t, size_t start, size_t end) {
+            for (size_t i = start; i < end; i++) {
+                if (i && i % 10000000 == 0) {
+                    std::lock_guard<std::mutex> lock(maps_mutex);
+                    if (!quiet_) {
+                        std::cout << "Processed " << 100 * i / container_size_ << "%% tokens from " << container_size_ << " in " << t << std::endl;
+                    }
+                    trim_to_budget();
+                }
+                size_t kmer_id = kmer2kmer_id.find(std::make_tuple(seq[i], seq[i + 1]));
+                array_of_tokens[i] = kmer_id;
+                array_of_prevs[i] = i == 0 ? i : i - 1;
+                array_of_nexts[i] = i == n_pairs - 1 ? container_size_ : i + 1;
+                if (!help_tokens[kmer_id]) {
+                    counter.increase(kmer_id, get_weight(i));
+                    counter.add_position_unordered(kmer_id, i);
+                }
+            }
+        });
+        size_ = n_pairs;
+
+        // a single pass appends positions in order
+        run_in_threads([&](size_t t, size_t start, size_t end) {
+            for (size_t kmer_id = 1 + t; kmer_id < total_counts.size(); kmer_id += num_threads) {
+                if (!help_tokens[kmer_id]) {
+                    counter.get_positions(kmer_id).sort();
+                }
+            }
+        });
 
         for (size_t i = 1; i < counter.size(); i++) {
             if (counter.is_helper_kmer(i) || counter.get(i) == 0) {
@@ -128,7 +197,7 @@ public:
         }
     }
 
-    void process_item(size_t i, const std::vector<TokenType>& seq, std::unordered_map<Kmer, size_t, TupleHash>& kmer2kmer_id, std::unordered_map<size_t, Kmer>& kmer_id2kmer) {
+    void process_item(size_t i, const std::vector<TokenType>& seq, KmerIndex& kmer2kmer_id, std::vector<Kmer>& kmer_id2kmer) {
         TokenType a = seq[i];
         TokenType b = seq[i + 1];
         Kmer pair = std::make_tuple(a, b);
@@ -138,17 +207,14 @@ public:
             help_token = 1;
         }
 
-        if (kmer2kmer_id.find(pair) == kmer2kmer_id.end()) {
-            std::lock_guard<std::mutex> lock(maps_mutex);
-            kmer2kmer_id[pair] = kmer2kmer_id.size();
-            kmer_id2kmer[kmer_id2kmer.size()] = pair;
+        size_t kmer_id = kmer2kmer_id.insert(pair);
+        if (kmer_id == kmer_id2kmer.size()) {
+            kmer_id2kmer.push_back(pair);
             if (!help_token) {
-                counter.init_positions(kmer2kmer_id[pair], container_size_/12);
+                counter.init_positions(kmer_id, positions_capacity_);
             }
         }
 
-        size_t kmer_id = kmer2kmer_id[pair];
-
         array_of_tokens[i] = kmer_id;
         if (i == 0) {
             array_of_prevs[i] = i;
@@ -164,20 +230,23 @@ public:
 
         counter.set_token(kmer_id, help_token);
         if (!help_token) {
-            counter.increase(kmer_id);
+            counter.increase(kmer_id, get_weight(i));
             counter.add_position(kmer_id, i);
         }
         size_++;
     }
 
-    void init_in_single_thread(const std::vector<TokenType>& seq, std::unordered_map<Kmer, size_t, TupleHash>& kmer2kmer_id, std::unordered_map<size_t, Kmer>& kmer_id2kmer) {
+    void init_in_single_thread(const std::vector<TokenType>& seq, KmerIndex& kmer2kmer_id, std::vector<Kmer>& kmer_id2kmer) {
         
         counter.set_token(0, 1);
 
         for (size_t i = 0; i < container_size_ - 1; i++) {
 
             if (i && i % 1000000 == 0) {
-                std::cout << "Processed " << 100 * i / container_size_ << "%% tokens from " << container_size_ << std::endl;
+                if (!quiet_) {
+                    std::cout << "Processed " << 100 * i / container_size_ << "%% tokens from " << container_size_ << std::endl;
+                }
+                trim_to_budget();
             }
             process_item(i, seq, kmer2kmer_id, kmer_id2kmer);
         }
@@ -189,50 +258,60 @@ public:
         }
     }
 
-    SequenceContainer(const std::vector<TokenType>& seq, std::unordered_map<Kmer, size_t, TupleHash>& kmer2kmer_id, std::unordered_map<size_t, Kmer>& kmer_id2kmer, size_t num_threads) {
+    // positions_capacity is the initial length of the position lists built
+    // here; lists grow as needed, the default suits a sequence of nucleotides.
+    // With weights, one per token, the pair at i is counted weights[i] times.
+    // A quiet container prints no progress, for containers that run side by
+    // side on threads of their own (LocalShardedEngine).
+    SequenceContainer(const std::vector<TokenType>& seq, KmerIndex& kmer2kmer_id, std::vector<Kmer>& kmer_id2kmer, size_t num_threads, size_t positions_capacity = 0, const std::vector<CounterType>* weights = nullptr, bool quiet = false) {
         
-        std::cout << "Initializing container" << std::endl;
+        quiet_ = quiet;
+        if (weights != nullptr) {
+            weights_ = *weights;
+        }
+        if (!quiet_) {
+            std::cout << "Initializing container" << std::endl;
+        }
         size_ = 0;
-        array_of_tokens = new size_t[seq.size()];
-        array_of_prevs = new size_t[seq.size()];
-        array_of_nexts = new size_t[seq.size()+2];
+        // arrays come zeroed, file-backed in out-of-core mode
+        array_of_tokens = allocate_array<size_t>(seq.size()); // 1-based, zero is reserved for empty
+        array_of_prevs = allocate_array<size_t>(seq.size()); // 0-base, head as index == prevs
+        array_of_nexts = allocate_array<size_t>(seq.size()+2); // 0-base, tail as next == total size
         container_size_ = seq.size();
+        positions_capacity_ = positions_capacity ? positions_capacity : container_size_ / 12;
 
-        for (size_t i = 0; i < container_size_; i++) {
-            array_of_tokens[i] = 0; // 1-based, zero is reserved for empty
-            array_of_prevs[i] = 0; // 0-base, head as index == prevs
-            array_of_nexts[i] = 0; // 0-base, tail as next == total size
-        }
-        for (size_t i = container_size_-2; i < container_size_+2; i++) {
-            array_of_nexts[i] = 0;
-        }
         // positions also 1-based
-        std::cout << "Done" << std::endl;
+        if (!quiet_) {
+            std::cout << "Done" << std::endl;
+        }
 
-        counter = CounterContainer(kmer_id2kmer.size());
+        // every replaced pair makes at most two new kmers, so there are fewer
+        // than 3n kmer ids and a short sequence needs no 40M entry counter
+        counter = CounterContainer(kmer_id2kmer.size(), std::min(COUNTER_DEFAULT_SIZE, 3 * seq.size() + 16));
 
         if (num_threads == 1) {
             init_in_single_thread(seq, kmer2kmer_id, kmer_id2kmer);
         } else {
             init_in_threads(seq, kmer2kmer_id, kmer_id2kmer, num_threads);
         }
+        counter.pack_positions();
     }
 
-    SequenceContainer(const std::string& bpe_file, const std::string& pos_file, const std::vector<TokenType>& seq, std::unordered_map<Kmer, size_t, TupleHash>& kmer2kmer_id, std::unordered_map<size_t, Kmer>& kmer_id2kmer) {
+    SequenceContainer(const std::string& bpe_file, const std::string& pos_file, const std::vector<TokenType>& seq, KmerIndex& kmer2kmer_id, std::vector<Kmer>& kmer_id2kmer) {
         // read pos file (kmer_id, kmer, merge pair, _, tf, poses)
         std::ifstream pos_stream(pos_file);
         std::string line;
         std::getline(pos_stream, line); // skip header
     }
 
-    void display(std::unordered_map<TokenType, std::string>& alphabet_map, std::unordered_map<size_t, Kmer>& kmer_id2kmer) {
+    void display(const TokenStrings& token_strings, std::vector<Kmer>& kmer_id2kmer) {
         
         for (size_t i=0; i < container_size_; i++) {
             if (array_of_tokens[i] == 0) {
                 continue;
             }
             Kmer kmer = kmer_id2kmer[array_of_tokens[i]];
-            std::cout << alphabet_map.at(std::get<0>(kmer)) << "|" << alphabet_map.at(std::get<1>(kmer)) << " ";
+            std::cout << token_strings.at(std::get<0>(kmer)) << "|" << token_strings.at(std::get<1>(kmer)) << " ";
         }
         std::cout << std::endl;
     }
@@ -261,83 +340,7 @@ public:
         
     }
 
-    void save_bpe_to_file(const std::string& output_bpe_encoding_file, const std::string& output_bpe_raw_encoding_file, std::unordered_map<TokenType, std::string>& alphabet_map, std::unordered_map<size_t, Kmer>& kmer_id2kmer) {
-        std::ofstream out_file(output_bpe_encoding_file);
-        std::ofstream out_raw_file(output_bpe_raw_encoding_file);
-        if (out_file.is_open()) {
-            std::string last;
-            TokenType last_token = 0;
-            for (size_t i=0; i < container_size_; i++) {
-                if (array_of_tokens[i] == 0) {
-                    continue;
-                }
-                Kmer kmer = kmer_id2kmer[array_of_tokens[i]];
-                size_t next_i = array_of_nexts[i];
-                size_t next_token_id = array_of_tokens[next_i];
-                Kmer next_kmer = kmer_id2kmer[next_token_id];
-
-                std::cout << "Debug: " <<  std::get<0>(kmer) << "|" << std::get<1>(kmer) << " " << alphabet_map.at(std::get<0>(kmer)) << "|" << alphabet_map.at(std::get<1>(kmer)) << " " << std::endl;
-
-                if (std::get<0>(kmer) != 5 && std::get<1>(kmer) != 5) {
-                    
-
-                    out_file << alphabet_map.at(std::get<0>(kmer)) << " ";
-                    std::cout << "TOFILE=>" << alphabet_map.at(std::get<0>(kmer)) << " ";
-
-                    out_raw_file << std::get<0>(kmer) << " ";
-
-                    last = alphabet_map.at(std::get<1>(kmer)); 
-                    last_token = std::get<1>(kmer);
-
-                    if (std::get<1>(next_kmer) == 5) { // ... ~|X
-                        // if (last != "") {
-                        //     out_file << last;
-                        //     std::cout << last; // to file edbug
-
-                        //     out_raw_file << last_token;
-                        // }
-                        last = "";
-                        
-                        std::cout << "<<--" << std::endl;
-                        continue;
-                    }               
-                }
-
-                // if (std::get<0>(kmer) == 5) { // ~|X
-                //     out_file << "\n";
-                //     std::cout << "\n"; // to file edbug
-
-                //     out_raw_file << "\n";    
-                    
-                //     std::cout << "<<--" << std::endl;
-                //     continue;
-                // }
-
-                if (std::get<1>(kmer) == 5) { // X|~
-                    out_file << alphabet_map.at(std::get<0>(kmer)) << "\n";
-                    out_raw_file << std::get<0>(kmer) << "\n";
-                    
-                    std::cout << alphabet_map.at(std::get<0>(kmer)) << "<<--" << std::endl;
-                    continue;
-                }
-
-
-                std::cout << "<<--" << std::endl;
-            }
-            if (last != "") {
-                out_file << last;
-                std::cout << last; // to file edbug
-                
-                out_raw_file << last_token;
-            }
-
-            std::cout << "<<--" << std::endl;
-            out_file.close();
-            out_raw_file.close();
-        }
-    }
-
-    void print_bpe_to_stdout(std::unordered_map<TokenType, std::string>& alphabet_map, std::unordered_map<size_t, Kmer>& kmer_id2kmer) {
+    void print_bpe_to_stdout(const TokenStrings& token_strings, std::vector<Kmer>& kmer_id2kmer) {
         
         std::string last;
         TokenType last_token = 0;
@@ -355,8 +358,8 @@ public:
             if (std::get<0>(kmer) != 5 && std::get<1>(kmer) != 5) {
                 
 
-                std::cout << alphabet_map.at(std::get<0>(kmer));
-                last = alphabet_map.at(std::get<1>(kmer)); 
+                std::cout << token_strings.at(std::get<0>(kmer));
+                last = token_strings.at(std::get<1>(kmer)); 
                 last_token = std::get<1>(kmer);
 
                 if (std::get<1>(next_kmer) == 5) { // ... ~|X
@@ -383,7 +386,7 @@ public:
         }
     }
 
-    void print_raw_bpe_to_stdout(std::unordered_map<TokenType, std::string>& alphabet_map, std::unordered_map<size_t, Kmer>& kmer_id2kmer) {
+    void print_raw_bpe_to_stdout(const TokenStrings& token_strings, std::vector<Kmer>& kmer_id2kmer) {
         
         std::string last;
         TokenType last_token = 0;
@@ -402,7 +405,7 @@ public:
                 
 
                 std::cout << std::get<0>(kmer) << " ";
-                last = alphabet_map.at(std::get<1>(kmer)); 
+                last = token_strings.at(std::get<1>(kmer)); 
                 last_token = std::get<1>(kmer);
 
                 if (std::get<1>(next_kmer) == 5) { // ... ~|X
@@ -429,19 +432,27 @@ public:
         }
     }
 
-    void print_queue(std::unordered_map<TokenType, std::string>& alphabet_map, std::unordered_map<size_t, Kmer>& kmer_id2kmer) {
+    void print_queue(const TokenStrings& token_strings, std::vector<Kmer>& kmer_id2kmer) {
         
         // iter and print max_heap
         auto temp = max_heap;
         while (!temp.empty()) {
             Kmer kmer = kmer_id2kmer[temp.top().second];
-            std::cout << temp.top().first << " " << alphabet_map.at(std::get<0>(kmer)) << "|" << alphabet_map.at(std::get<1>(kmer)) << " real counts: " << counter.get(temp.top().second) << std::endl;
+            std::cout << temp.top().first << " " << token_strings.at(std::get<0>(kmer)) << "|" << token_strings.at(std::get<1>(kmer)) << " real counts: " << counter.get(temp.top().second) << std::endl;
             temp.pop();
         }
     }
 
-    bool removeAtIndex(size_t index, std::unordered_map<Kmer, size_t, TupleHash>& kmer2kmer_id, std::unordered_map<size_t, Kmer>& kmer_id2kmer, std::unordered_map<TokenType, std::string>& alphabet_map) {
+    bool removeAtIndex(size_t index) {
         size_t kmer_id = array_of_tokens[index];
+        unlink(index);
+        change_count(kmer_id, -1, index);
+        size_--;
+        return true;
+    }
+
+    // takes the node at index out of the list, without counting
+    void unlink(size_t index) {
         array_of_tokens[index] = 0;
         if (index == array_of_prevs[index]) {
             /// START A|B ...
@@ -462,50 +473,81 @@ public:
             array_of_prevs[array_of_nexts[index]] = array_of_prevs[index];
             // print_raw_bpe_to_stdout(alphabet_map, kmer_id2kmer);
         }
-        counter.decrease(kmer_id);
-        size_--;
-        return true;
     }
 
-    void init_new_kmer(Kmer kmer, char is_help_token, std::unordered_map<Kmer, size_t, TupleHash>& kmer2kmer_id, std::unordered_map<size_t, Kmer>& kmer_id2kmer) {
-        if (kmer2kmer_id.find(kmer) == kmer2kmer_id.end()) {
-            kmer2kmer_id[kmer] = kmer2kmer_id.size();
-            kmer_id2kmer[kmer_id2kmer.size()] = kmer;
-            counter.set_token(kmer2kmer_id[kmer], is_help_token);
-            counter.init_positions(kmer2kmer_id[kmer], 1000);
-        }
+    // id of the kmer, which is set up first if it is new
+    size_t init_new_kmer(Kmer kmer, char is_help_token, KmerIndex& kmer2kmer_id, std::vector<Kmer>& kmer_id2kmer) {
+        size_t kmer_id = kmer2kmer_id.insert(kmer);
+        if (kmer_id == kmer_id2kmer.size()) {
+            kmer_id2kmer.push_back(kmer);
+            counter.set_token(kmer_id, is_help_token);
+            // starts inline and grows through the size classes of the slab
+            counter.init_positions(kmer_id, 0);
+            stats_.new_kmers++;
+        }
+        return kmer_id;
     }
 
 
-    void collapse(size_t kmer_id, TokenType L, std::unordered_map<Kmer, size_t, TupleHash>& kmer2kmer_id, std::unordered_map<size_t, Kmer>& kmer_id2kmer, std::unordered_map<TokenType, std::string>& alphabet_map) {
+    void collapse(size_t kmer_id, TokenType L, KmerIndex& kmer2kmer_id, std::vector<Kmer>& kmer_id2kmer) {
         // We have:
         //     kmer_id: kmer_id
         //     kmer2kmer_id: kmer -> kmer_id
         //     kmer_id2kmer: kmer_id -> kmer
-        //     alphabet_map: TokenType -> std::string
 
         std::unordered_set<size_t> touched_kmers; // kmers that were touched during the collapse and should be updated
         PositionsContainer& positions = counter.get_positions(kmer_id); // we have precomputed positions for kmer_id
 
-        
+        // positions are walked in ascending order, so that the arrays are swept
+        // from left to right rather than read (or faulted in, out of core) at
+        // random. Lists come sorted out of init and out of collapse, which
+        // appends in the order it walks; a list that is not is sorted here, the
+        // first time it is walked. For a self-pair the order decides which
+        // overlapping occurrences merge, so it is kept.
+        const Kmer& collapsed_kmer = kmer_id2kmer[kmer_id];
+        const bool is_self_pair = std::get<0>(collapsed_kmer) == std::get<1>(collapsed_kmer);
+        if (!positions.is_sorted() && !is_self_pair) {
+            positions.sort();
+        }
+        // in a sorted list the first live node of a run of a self-pair comes
+        // before the rest of the run, which is then merged as a whole there
+        const bool merge_runs = is_self_pair && positions.is_sorted();
+
+        // the list of kmer_id does not change during the walk, new positions go
+        // to the lists of the new kmers; ahead runs PREFETCH_DISTANCE in front
+        const size_t n_positions = positions.size();
+        PositionsReader reader(positions);
+        PositionsReader ahead(positions);
+        for (size_t i = 0; i < PREFETCH_DISTANCE && i < n_positions; i++) {
+            ahead.next();
+        }
 
-        for (size_t i = 0; i < positions.size(); i++) {
+        for (size_t i = 0; i < n_positions; i++) {
 
             // for (size_t j=0; j < container_size_; j++) {
             //     std::cout << j << " " << array_of_prevs[j] << " " << array_of_tokens[j] << " " << array_of_nexts[j] << std::endl;
             // }
 
-            if (positions.get_plus_one_position(i) == 0) {
+            if (i + PREFETCH_DISTANCE < n_positions) {
+                prefetch_node(ahead.next());
+            }
+            stats_.positions_visited++;
+            size_t index = reader.next();
+            if (index == 0) {
                 continue;
             }
-            if (i && i % 10000000 == 0) {
+            if (i && i % 10000000 == 0 && !quiet_) {
                 std::cout << "Processed " << i << " positions." << std::endl;
             }
-            size_t index = positions.get_plus_one_position(i);
 
             if (index > 0 && kmer_id == array_of_tokens[index-1]) {
                 
                 index -= 1;
+                if (merge_runs) {
+                    collapse_run(index, kmer_id, L, touched_kmers, kmer2kmer_id, kmer_id2kmer);
+                    continue;
+                }
+                stats_.positions_live++;
                 
                 size_t prev_index = array_of_prevs[index];
                 size_t next_index = array_of_nexts[index];
@@ -516,12 +558,10 @@ public:
 
                 if (index != array_of_prevs[index] && !is_prev_helper) {
                     
-                    Kmer prevKmer = kmer_id2kmer[prev_kmer_id];
-                    Kmer left_kmer = std::make_tuple(std::get<0>(prevKmer), L);
-                    init_new_kmer(left_kmer, is_prev_helper, kmer2kmer_id, kmer_id2kmer);
-                    size_t left_kmer_id = kmer2kmer_id[left_kmer];
-                    counter.decrease(prev_kmer_id);
-                    counter.increase(left_kmer_id);
+                    Kmer left_kmer = std::make_tuple(std::get<0>(kmer_id2kmer[prev_kmer_id]), L);
+                    size_t left_kmer_id = init_new_kmer(left_kmer, is_prev_helper, kmer2kmer_id, kmer_id2kmer);
+                    change_count(prev_kmer_id, -1, prev_index);
+                    change_count(left_kmer_id, 1, prev_index);
                     
                     counter.add_position(left_kmer_id, prev_index);       
                     array_of_tokens[prev_index] = left_kmer_id;
@@ -535,15 +575,11 @@ public:
                     
                     
 
-                    Kmer next_kmer = kmer_id2kmer[next_kmer_id];
-                    Kmer right_kmer = std::make_tuple(L, std::get<1>(next_kmer));                    
-                    
-                    init_new_kmer(right_kmer, is_next_helper, kmer2kmer_id, kmer_id2kmer);
-                        
-                    size_t right_kmer_id = kmer2kmer_id[right_kmer];
+                    Kmer right_kmer = std::make_tuple(L, std::get<1>(kmer_id2kmer[next_kmer_id]));
+                    size_t right_kmer_id = init_new_kmer(right_kmer, is_next_helper, kmer2kmer_id, kmer_id2kmer);
 
-                    counter.decrease(next_kmer_id);
-                    counter.increase(right_kmer_id);
+                    change_count(next_kmer_id, -1, next_index);
+                    change_count(right_kmer_id, 1, next_index);
                         
                     counter.add_position(right_kmer_id, next_index); 
                 
@@ -560,7 +596,7 @@ public:
                 
                 // print_bpe_to_stdout(alphabet_map, kmer_id2kmer);
                 // print_raw_bpe_to_stdout(alphabet_map, kmer_id2kmer);
-                removeAtIndex(index, kmer2kmer_id, kmer_id2kmer, alphabet_map);
+                removeAtIndex(index);
                 // print_raw_bpe_to_stdout(alphabet_map, kmer_id2kmer);
                 // print_bpe_to_stdout(alphabet_map, kmer_id2kmer);
 
@@ -591,6 +627,7 @@ public:
                 return std::pair(kmer_id, count);
             }
             max_heap.pop();
+            stats_.stale_heap_pops++;
         }
         throw std::runtime_error("Could not find the most frequent pair.");
     }
@@ -599,39 +636,175 @@ public:
         return size_;
     }
 
+    const ContainerStats& stats() const {
+        return stats_;
+    }
+
+    size_t get_count(size_t kmer_id) {
+        return counter.get(kmer_id);
+    }
+
+    // collapse appends every count change to log as (kmer_id, delta), nullptr stops it
+    void log_count_changes(std::vector<std::pair<size_t, int>>* log) {
+        count_log_ = log;
+    }
+
     
-    std::vector<TokenType> get_as_vector(std::unordered_map<size_t, Kmer>& kmer_id2kmer) {
+    std::vector<TokenType> get_as_vector(std::vector<Kmer>& kmer_id2kmer) {
         std::vector<TokenType> token_vector;
-        token_vector.reserve(size_);
+        token_vector.reserve(size_ + 1);
 
+        size_t last_kmer_id = 0;
         for (size_t i=0; i < container_size_; ++i) {
             if (array_of_tokens[i] != 0) {
-                size_t kmer_id = array_of_tokens[i];
-                Kmer kmer = kmer_id2kmer.at(kmer_id);
+                last_kmer_id = array_of_tokens[i];
+                Kmer kmer = kmer_id2kmer.at(last_kmer_id);
                 token_vector.emplace_back(std::get<0>(kmer));
             }
-            if (i == container_size_ - 1) {
-                size_t kmer_id = array_of_tokens[i];
-                Kmer kmer = kmer_id2kmer.at(kmer_id);
-                token_vector.emplace_back(std::get<1>(kmer));
-            }
+        }
+        // the last live pair also holds the closing token of the sequence
+        if (last_kmer_id != 0) {
+            Kmer kmer = kmer_id2kmer.at(last_kmer_id);
+            token_vector.emplace_back(std::get<1>(kmer));
         }
         return token_vector;
     }
     
     ~SequenceContainer() {
-        if (array_of_tokens != nullptr) {
-            delete[] array_of_tokens;
-        }
-        if (array_of_prevs != nullptr) {
-            delete[] array_of_prevs;
+        free_array(array_of_tokens);
+        free_array(array_of_prevs);
+        free_array(array_of_nexts);
+    }
+
+private:
+
+    // occurrences are sparse in long sequences, so every one is a cache and
+    // TLB miss; collapse asks for the nodes this many positions ahead. On 30 Mb
+    // of synthetic sequence this took 6% off the collapse time of the first
+    // 3000 merges, later merges with short lists gain nothing measurable
+    static const size_t PREFETCH_DISTANCE = 16;
+
+    // starts loading the node of a position (stored plus one) and the node
+    // after it, which is where its right neighbour is unless removed
+    void prefetch_node(size_t plus_one_index) const {
+        if (plus_one_index == 0) {
+            return;
+        }
+        size_t index = plus_one_index - 1;
+        __builtin_prefetch(array_of_tokens + index);
+        __builtin_prefetch(array_of_tokens + index + 1);
+        __builtin_prefetch(array_of_prevs + index);
+        __builtin_prefetch(array_of_nexts + index);
+    }
+
+    // Merges the run of the self-pair (X, X) that starts at node first. A run
+    // of k tokens X is k - 1 nodes in a row, and merging its occurrences left
+    // to right takes every other node: k / 2 tokens L come out, and one X is
+    // left over if k is odd. So the 1st, 3rd, ... nodes are removed, the 2nd,
+    // 4th, ... become (L, L), except that the last node of an even number
+    // becomes (L, X), and the pairs around the run become (x, L) and, if k is
+    // even, (L, y). The counts change by sums over the run: (X, X) loses k - 1,
+    // (L, L) gains k / 2 - 1, (L, X) gains one if k is odd. New kmers are set
+    // up in the order the occurrences would set them up one by one, so the ids
+    // and everything after are the same.
+    void collapse_run(size_t first, size_t kmer_id, TokenType L, std::unordered_set<size_t>& touched_kmers, KmerIndex& kmer2kmer_id, std::vector<Kmer>& kmer_id2kmer) {
+        size_t n_nodes = 1;
+        size_t last = first;
+        while (array_of_nexts[last] != container_size_ && array_of_tokens[array_of_nexts[last]] == kmer_id) {
+            last = array_of_nexts[last];
+            n_nodes++;
+        }
+        const size_t n_merged = (n_nodes + 1) / 2;
+        const TokenType X = std::get<0>(kmer_id2kmer[kmer_id]);
+        stats_.positions_live += n_merged;
+        touched_kmers.insert(kmer_id);
+
+        // (x, X) -> (x, L)
+        size_t prev_index = array_of_prevs[first];
+        size_t prev_kmer_id = array_of_tokens[prev_index];
+        char is_prev_helper = counter.is_helper_kmer(prev_kmer_id);
+        if (first != prev_index && !is_prev_helper) {
+            Kmer left_kmer = std::make_tuple(std::get<0>(kmer_id2kmer[prev_kmer_id]), L);
+            size_t left_kmer_id = init_new_kmer(left_kmer, is_prev_helper, kmer2kmer_id, kmer_id2kmer);
+            change_count(prev_kmer_id, -1, prev_index);
+            change_count(left_kmer_id, 1, prev_index);
+            counter.add_position(left_kmer_id, prev_index);
+            array_of_tokens[prev_index] = left_kmer_id;
+            touched_kmers.insert(prev_kmer_id);
+            touched_kmers.insert(left_kmer_id);
+        }
+        size_t tail_kmer_id = 0; // (L, X)
+        size_t inner_kmer_id = 0; // (L, L)
+        if (n_nodes >= 2) {
+            tail_kmer_id = init_new_kmer(std::make_tuple(L, X), 0, kmer2kmer_id, kmer_id2kmer);
+            touched_kmers.insert(tail_kmer_id);
+        }
+        if (n_nodes >= 3) {
+            inner_kmer_id = init_new_kmer(std::make_tuple(L, L), 0, kmer2kmer_id, kmer_id2kmer);
+            touched_kmers.insert(inner_kmer_id);
+        }
+
+        // (X, y) -> (L, y), when the last node is merged
+        size_t next_index = array_of_nexts[last];
+        if (n_nodes % 2 == 1 && next_index != container_size_) {
+            size_t next_kmer_id = array_of_tokens[next_index];
+            char is_next_helper = counter.is_helper_kmer(next_kmer_id);
+            Kmer right_kmer = std::make_tuple(L, std::get<1>(kmer_id2kmer[next_kmer_id]));
+            size_t right_kmer_id = init_new_kmer(right_kmer, is_next_helper, kmer2kmer_id, kmer_id2kmer);
+            change_count(next_kmer_id, -1, next_index);
+            change_count(right_kmer_id, 1, next_index);
+            counter.add_position(right_kmer_id, next_index);
+            array_of_tokens[next_index] = right_kmer_id;
+            touched_kmers.insert(next_kmer_id);
+            touched_kmers.insert(right_kmer_id);
+        }
+
+        // the run itself, weights summed per kmer; unlinking a node leaves
+        // its own next in place
+        CounterType run_weight = 0;
+        CounterType inner_weight = 0;
+        size_t node = first;
+        for (size_t i = 0; i < n_nodes; i++, node = array_of_nexts[node]) {
+            run_weight += get_weight(node);
+            if (i % 2 == 0) {
+                unlink(node);
+            } else if (i + 1 < n_nodes) {
+                inner_weight += get_weight(node);
+                counter.add_position(inner_kmer_id, node);
+                array_of_tokens[node] = inner_kmer_id;
+            } else {
+                change_count(tail_kmer_id, 1, node);
+                counter.add_position(tail_kmer_id, node);
+                array_of_tokens[node] = tail_kmer_id;
+            }
         }
-        if (array_of_nexts != nullptr) {
-            delete[] array_of_nexts;
+        change_count_by(kmer_id, -1, run_weight);
+        if (inner_weight > 0) {
+            change_count_by(inner_kmer_id, 1, inner_weight);
         }
+        size_ -= n_merged;
     }
 
-private:
+    CounterType get_weight(size_t index) const {
+        return weights_.empty() ? 1 : weights_[index];
+    }
+
+    // the pair at index was added (delta 1) or removed (delta -1)
+    void change_count(size_t kmer_id, int delta, size_t index) {
+        change_count_by(kmer_id, delta, get_weight(index));
+    }
+
+    // the pair was added (delta 1) or removed (delta -1) at pairs of this total weight
+    void change_count_by(size_t kmer_id, int delta, CounterType weight) {
+        if (delta > 0) {
+            counter.increase(kmer_id, weight);
+        } else {
+            counter.decrease(kmer_id, weight);
+        }
+        if (count_log_ != nullptr) {
+            count_log_->emplace_back(kmer_id, delta * (int)weight);
+        }
+    }
 
     struct ComparePair {
         bool operator()(const std::pair<size_t, size_t> &a, const std::pair<size_t, size_t> &b) const {
@@ -643,6 +816,8 @@ private:
     };
 
     size_t container_size_ = 0;
+    size_t positions_capacity_ = 0;
+    bool quiet_ = false; // no progress output
     size_t* array_of_tokens = nullptr;
     size_t* array_of_prevs = nullptr;
     size_t* array_of_nexts = nullptr;
@@ -650,6 +825,9 @@ private:
     size_t size_ = 0;
     std::priority_queue<std::pair<size_t, size_t>, std::vector<std::pair<size_t, size_t>>, ComparePair> max_heap;
     uint merge_count = 0;
+    ContainerStats stats_;
+    std::vector<std::pair<size_t, int>>* count_log_ = nullptr;
+    std::vector<CounterType> weights_; // empty: every pair counts once
 };
 
 #endif
\ No newline at end of file
@@ -11,6 +11,7 @@
 #include "tokens.hpp"
 #include <iostream>
 #include "container.hpp"
+#include "replace.hpp"
 
 typedef std::unordered_map<Kmer, size_t> Counter;
 
@@ -172,37 +173,7 @@ std::pair<std::size_t, Kmer> found_max(const std::vector<std::atomic_size_t>& c,
 }
 
 void transform_data(std::vector<TokenType> &seq, Kmer& rep, TokenType L, uint k=2) {
-    
-    std::vector<TokenType> new_seq;
-    new_seq.reserve(seq.size());
-
-    std::vector<int> to_replace;
-    to_replace.resize(seq.size());
-
-    std::fill(to_replace.begin(), to_replace.end(), 0);
-    for (size_t i = 0; i < seq.size() - k + 1; i++) {
-        if (seq[i] > N_HELP_TOKENS && seq[i+1] > N_HELP_TOKENS) {
-            Kmer kmer_ = std::make_tuple(seq[i], seq[i+1]);
-            if (kmer_ == rep) {
-                to_replace[i] = 1;
-            }
-        }
-    }
-    
-    new_seq.clear();
-    new_seq.reserve(seq.size());
-    for (size_t i = 0; i < seq.size();) {
-        if (to_replace[i]) {
-            new_seq.push_back(L);
-            i += 2;
-        } else {
-            new_seq.push_back(seq[i]);
-            i += 1;
-        }
-    }
-
-    seq = std::vector<TokenType>(new_seq.begin(), new_seq.end());
-    
+    replace_pair(seq, std::get<0>(rep), std::get<1>(rep), L, 1);
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,243 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <filesystem>
+
+#include "readers.hpp"
+#include "npy.hpp"
+#include "decoder.hpp"
+
+// Decoder from token ids back to sequences: the vocabulary blob written by
+// training is mapped into memory and every token is copied out of it with one
+// memcpy. Records are decoded in parallel straight into their place in the
+// output, one sequence per line. With --check the result is compared record
+// by record with the input the encoding was made from.
+
+const std::string decode_usage =
+    "Usage: decode.exe <prefix.n.vocab.bin> <encoding: prefix.n.raw.bpe or prefix.n.tokens.npy> <output_file> <threads> [--check <input_file> <format: reads, fasta, trf, fastq>]\n";
+
+// token ids of all records back to back, record i is ids[offsets[i]:offsets[i + 1]]
+void read_raw_bpe(const std::string& file_name, std::vector<uint32_t>& ids, std::vector<uint64_t>& offsets) {
+    std::ifstream file(file_name, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Error: Could not open file " << file_name << std::endl;
+        exit(1);
+    }
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    const std::string data = buffer.str();
+    offsets.assign(1, 0);
+    uint64_t value = 0;
+    bool in_number = false;
+    for (char c : data) {
+        if (c >= '0' && c <= '9') {
+            value = value * 10 + (c - '0');
+            in_number = true;
+            continue;
+        }
+        // an empty record is written as a lone separator 5, which is not a token of it
+        if (in_number && value != 5) {
+            ids.push_back(value);
+        }
+        value = 0;
+        in_number = false;
+        if (c == '\n') {
+            offsets.push_back(ids.size());
+        }
+    }
+    if (in_number && value != 5) {
+        ids.push_back(value);
+    }
+    if (offsets.back() != ids.size()) {
+        offsets.push_back(ids.size());
+    }
+}
+
+// runs worker(first, last) on ranges of records with about equal numbers of tokens
+void run_on_records(const uint64_t* offsets, size_t n_records, size_t n_threads, const std::function<void(size_t, size_t)>& worker) {
+    std::vector<std::thread> threads;
+    size_t first = 0;
+    for (size_t t = 1; t <= n_threads; t++) {
+        size_t last = n_records;
+        if (t < n_threads) {
+            uint64_t target = offsets[n_records] * t / n_threads;
+            last = std::lower_bound(offsets + first, offsets + n_records, target) - offsets;
+        }
+        threads.emplace_back(worker, first, last);
+        first = last;
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+// the records as text, each followed by a newline; line_offsets gets where each starts
+template<typename T>
+std::string decode_records(const VocabBlob& vocab, const T* ids, const uint64_t* offsets, size_t n_records, size_t n_threads, std::vector<uint64_t>& line_offsets) {
+    line_offsets.assign(n_records + 1, 0);
+    std::atomic<bool> failed(false);
+    run_on_records(offsets, n_records, n_threads, [&](size_t first, size_t last) {
+        for (size_t i = first; i < last; i++) {
+            int64_t length = get_decoded_length(vocab, ids + offsets[i], offsets[i + 1] - offsets[i]);
+            if (length < 0) {
+                failed = true;
+                return;
+            }
+            line_offsets[i + 1] = length + 1;
+        }
+    });
+    if (failed) {
+        std::cerr << "Error: token id out of the vocabulary of " << vocab.n_tokens << " tokens or a corrupt vocabulary" << std::endl;
+        exit(1);
+    }
+    for (size_t i = 0; i < n_records; i++) {
+        line_offsets[i + 1] += line_offsets[i];
+    }
+
+    std::string out(line_offsets[n_records], '\n');
+    run_on_records(offsets, n_records, n_threads, [&](size_t first, size_t last) {
+        for (size_t i = first; i < last; i++) {
+            decode_tokens(vocab, ids + offsets[i], offsets[i + 1] - offsets[i], &out[line_offsets[i]], line_offsets[i + 1] - line_offsets[i] - 1);
+        }
+    });
+    return out;
+}
+
+// number of records that differ from the input records, the first one is reported
+size_t check_records(const std::string& decoded, const std::vector<uint64_t>& line_offsets, const std::vector<std::string>& seqs, size_t n_threads) {
+    size_t n_records = line_offsets.size() - 1;
+    if (seqs.size() != n_records) {
+        std::cout << "Check: " << n_records << " records decoded, input has " << seqs.size() << std::endl;
+        return std::max(seqs.size(), n_records);
+    }
+    std::vector<uint64_t> record_offsets(n_records + 1);
+    for (size_t i = 0; i <= n_records; i++) {
+        record_offsets[i] = line_offsets[i] - i;
+    }
+    std::atomic<size_t> n_different(0);
+    std::atomic<size_t> first_different(n_records);
+    run_on_records(record_offsets.data(), n_records, n_threads, [&](size_t first, size_t last) {
+        for (size_t i = first; i < last; i++) {
+            size_t length = line_offsets[i + 1] - line_offsets[i] - 1;
+            if (length != seqs[i].size() || decoded.compare(line_offsets[i], length, seqs[i]) != 0) {
+                n_different++;
+                size_t current = first_different;
+                while (i < current && !first_different.compare_exchange_weak(current, i)) {
+                }
+            }
+        }
+    });
+    if (n_different) {
+        std::cout << "Check: " << n_different << " of " << n_records << " records differ, the first is record " << first_different << std::endl;
+    }
+    return n_different;
+}
+
+int main(int argc, char* argv[]) {
+
+    if (argc != 5 && argc != 8) {
+        std::cerr << decode_usage;
+        return 1;
+    }
+    std::string vocab_file = argv[1];
+    std::string encoding_file = argv[2];
+    std::string output_file = argv[3];
+    size_t n_threads = std::max(1ul, std::stoul(argv[4]));
+    std::string check_file;
+    std::string check_format;
+    if (argc == 8) {
+        if (std::string(argv[5]) != "--check") {
+            std::cerr << decode_usage;
+            return 1;
+        }
+        check_file = argv[6];
+        check_format = argv[7];
+    }
+
+    VocabBlob vocab;
+    if (!open_vocab_blob(vocab_file, vocab)) {
+        std::cerr << "Error: Could not read vocabulary " << vocab_file << std::endl;
+        return 1;
+    }
+
+    auto start_time = std::chrono::high_resolution_clock::now();
+    std::vector<uint32_t> raw_ids;
+    std::vector<uint64_t> raw_offsets;
+    NpyArray tokens;
+    NpyArray offsets;
+    const std::string npy_suffix = ".tokens.npy";
+    bool is_npy = encoding_file.size() > npy_suffix.size() && encoding_file.compare(encoding_file.size() - npy_suffix.size(), npy_suffix.size(), npy_suffix) == 0;
+    if (is_npy) {
+        std::string offsets_file = encoding_file.substr(0, encoding_file.size() - npy_suffix.size()) + ".offsets.npy";
+        if (!open_npy(encoding_file, tokens) || !open_npy(offsets_file, offsets) || offsets.dtype != "<u8" || offsets.n == 0) {
+            std::cerr << "Error: Could not read " << encoding_file << " and " << offsets_file << std::endl;
+            return 1;
+        }
+    } else {
+        read_raw_bpe(encoding_file, raw_ids, raw_offsets);
+    }
+    auto read_time = std::chrono::high_resolution_clock::now();
+
+    std::vector<uint64_t> line_offsets;
+    std::string decoded;
+    if (!is_npy) {
+        decoded = decode_records(vocab, raw_ids.data(), raw_offsets.data(), raw_offsets.size() - 1, n_threads, line_offsets);
+    } else if (tokens.dtype == "<u2") {
+        decoded = decode_records(vocab, reinterpret_cast<const uint16_t*>(tokens.data), reinterpret_cast<const uint64_t*>(offsets.data), offsets.n - 1, n_threads, line_offsets);
+    } else if (tokens.dtype == "<u4") {
+        decoded = decode_records(vocab, reinterpret_cast<const uint32_t*>(tokens.data), reinterpret_cast<const uint64_t*>(offsets.data), offsets.n - 1, n_threads, line_offsets);
+    } else {
+        std::cerr << "Error: tokens must be uint16 or uint32, not " << tokens.dtype << std::endl;
+        return 1;
+    }
+    auto decode_time = std::chrono::high_resolution_clock::now();
+    size_t n_records = line_offsets.size() - 1;
+    auto read_ms = std::chrono::duration_cast<std::chrono::milliseconds>(read_time - start_time).count();
+    auto decode_us = std::chrono::duration_cast<std::chrono::microseconds>(decode_time - read_time).count();
+    std::cout << "Decoded " << n_records << " records, " << decoded.size() - n_records << " bases in " << decode_us / 1000 << " ms ("
+              << decoded.size() / std::max((long)decode_us, 1l) << " MB/s), reading took " << read_ms << " ms" << std::endl;
+
+    std::ofstream out(output_file, std::ios::binary);
+    if (!out.is_open()) {
+        std::cerr << "Error: Could not open file " << output_file << std::endl;
+        return 1;
+    }
+    out.write(decoded.data(), decoded.size());
+    out.close();
+
+    if (!check_file.empty()) {
+        if (!std::filesystem::exists(check_file)) {
+            std::cerr << "File " << check_file << " does not exist" << std::endl;
+            return 1;
+        }
+        std::vector<std::string> seqs;
+        if (check_format == "reads") {
+            get_sequences_reads(check_file, seqs);
+        } else if (check_format == "trf") {
+            get_sequences_trf(check_file, seqs);
+        } else if (check_format == "fasta") {
+            get_sequences_fasta(check_file, seqs);
+        } else if (check_format == "fastq") {
+            get_sequences_fastq(check_file, seqs);
+        } else {
+            std::cerr << "Format must be either reads or fasta or trf or fastq" << std::endl;
+            return 1;
+        }
+        if (check_records(decoded, line_offsets, seqs, n_threads)) {
+            return 1;
+        }
+        std::cout << "Check: all " << n_records << " records match " << check_file << std::endl;
+    }
+
+    close_npy(tokens);
+    close_npy(offsets);
+    close_vocab_blob(vocab);
+    return 0;
+}
@@ -0,0 +1,149 @@
+#ifndef DECODER_FILE_H
+#define DECODER_FILE_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <cstring>
+#include <cstdint>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tokens.hpp"
+
+// Vocabulary blob: the strings of all tokens back to back behind their
+// offsets, written by training as prefix.<n>.vocab.bin. The decoder maps it
+// into memory as it is, so decoding a token is one memcpy from the blob.
+// Layout: magic "DNABPEV1", uint64 n_tokens, uint64 offsets[n_tokens + 1],
+// then the strings; token t is strings[offsets[t]:offsets[t + 1]].
+
+const char VOCAB_BLOB_MAGIC[8] = {'D', 'N', 'A', 'B', 'P', 'E', 'V', '1'};
+
+struct VocabBlob {
+    void* mapping = nullptr; // nullptr when the arrays are owned by someone else
+    size_t bytes = 0;
+    uint64_t n_tokens = 0;
+    const uint64_t* offsets = nullptr;
+    const char* strings = nullptr;
+    uint64_t n_chars = 0; // bytes of strings
+};
+
+// start and length of the string of token, false if the token is not in the
+// vocabulary or its offsets are out of order or past the strings
+inline bool get_token_span(const VocabBlob& vocab, uint64_t token, uint64_t& start, uint64_t& length) {
+    if (token >= vocab.n_tokens) {
+        return false;
+    }
+    start = vocab.offsets[token];
+    uint64_t end = vocab.offsets[token + 1];
+    if (end < start || end > vocab.n_chars) {
+        return false;
+    }
+    length = end - start;
+    return true;
+}
+
+// tokens 0 .. n_tokens - 1 of token_strings, whose arena has the same layout
+void save_vocab_blob(const std::string& file_name, const TokenStrings& token_strings, uint64_t n_tokens) {
+    std::ofstream out(file_name, std::ios::binary);
+    if (!out.is_open()) {
+        std::cerr << "Error: Could not open file " << file_name << std::endl;
+        exit(1);
+    }
+    const std::vector<uint64_t>& offsets = token_strings.offsets;
+    out.write(VOCAB_BLOB_MAGIC, sizeof(VOCAB_BLOB_MAGIC));
+    out.write(reinterpret_cast<const char*>(&n_tokens), sizeof(n_tokens));
+    out.write(reinterpret_cast<const char*>(offsets.data()), (n_tokens + 1) * sizeof(uint64_t));
+    out.write(token_strings.strings.data(), offsets[n_tokens]);
+}
+
+// maps a vocabulary blob read-only, false if it cannot be read or is not one
+bool open_vocab_blob(const std::string& file_name, VocabBlob& vocab) {
+    int fd = open(file_name.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(VOCAB_BLOB_MAGIC) + 2 * sizeof(uint64_t)) {
+        close(fd);
+        return false;
+    }
+    void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+    const char* data = static_cast<const char*>(mapping);
+    size_t size = st.st_size;
+    uint64_t n_tokens;
+    memcpy(&n_tokens, data + sizeof(VOCAB_BLOB_MAGIC), sizeof(n_tokens));
+    // n_tokens + 1 offsets must fit in the file before anything is computed
+    // from them; a truncated or corrupt blob is refused rather than read past
+    size_t prefix = sizeof(VOCAB_BLOB_MAGIC) + sizeof(n_tokens);
+    if (memcmp(data, VOCAB_BLOB_MAGIC, sizeof(VOCAB_BLOB_MAGIC)) != 0 || n_tokens > (size - prefix) / sizeof(uint64_t) - 1) {
+        munmap(mapping, size);
+        return false;
+    }
+    size_t header = prefix + (n_tokens + 1) * sizeof(uint64_t);
+    const uint64_t* offsets = reinterpret_cast<const uint64_t*>(data + prefix);
+    bool valid = offsets[0] == 0 && offsets[n_tokens] == size - header;
+    for (uint64_t t = 0; valid && t < n_tokens; t++) {
+        valid = offsets[t] <= offsets[t + 1];
+    }
+    if (!valid) {
+        munmap(mapping, size);
+        return false;
+    }
+    vocab.mapping = mapping;
+    vocab.bytes = size;
+    vocab.n_tokens = n_tokens;
+    vocab.offsets = offsets;
+    vocab.strings = data + header;
+    vocab.n_chars = offsets[n_tokens];
+    return true;
+}
+
+void close_vocab_blob(VocabBlob& vocab) {
+    if (vocab.mapping != nullptr) {
+        munmap(vocab.mapping, vocab.bytes);
+    }
+    vocab = VocabBlob();
+}
+
+// number of characters the ids decode to, -1 if an id is not in the vocabulary
+template<typename T>
+int64_t get_decoded_length(const VocabBlob& vocab, const T* ids, size_t n) {
+    int64_t length = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint64_t start, token_length;
+        if (!get_token_span(vocab, ids[i], start, token_length)) {
+            return -1;
+        }
+        length += token_length;
+    }
+    return length;
+}
+
+// writes the strings of the ids to out, returns the number of characters
+// written or -1 if capacity is too small or an id is not in the vocabulary
+template<typename T>
+int64_t decode_tokens(const VocabBlob& vocab, const T* ids, size_t n, char* out, size_t capacity) {
+    size_t written = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint64_t start, length;
+        if (!get_token_span(vocab, ids[i], start, length)) {
+            return -1;
+        }
+        if (written + length > capacity) {
+            return -1;
+        }
+        memcpy(out + written, vocab.strings + start, length);
+        written += length;
+    }
+    return written;
+}
+
+#endif
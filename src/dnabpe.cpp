@@ -0,0 +1,204 @@
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
+
+#include "tokens.hpp"
+#include "decoder.hpp"
+#include "dnabpe.h"
+
+// libdnabpe: the merges of a trained vocabulary applied to new sequences.
+// Built as a shared library with hidden visibility, so only the dnabpe_
+// functions of dnabpe.h are exported and the globals of the headers stay
+// private to it.
+
+#define DNABPE_API extern "C" __attribute__((visibility("default")))
+
+struct dnabpe_model {
+    TokenType first_token = 0;
+    TokenType n_tokens = 0;
+    bool can_encode = false; // a model from a vocabulary blob only decodes
+    std::unordered_map<uint64_t, TokenType> pair_tokens; // a << 32 | b -> merged token
+    std::vector<TokenType> char_tokens; // token of each input character
+    TokenStrings token_strings; // strings of all tokens back to back
+    VocabBlob vocab; // the strings, in token_strings or mapped from a file
+};
+
+// Per-thread working memory of the encoder: the sequence as a linked list of
+// tokens and a min-heap of candidate merges (token, position), so that merges
+// are applied in the order they were learned and, for the same pair, left to
+// right, as in training.
+struct EncoderScratch {
+    std::vector<TokenType> tokens;
+    std::vector<size_t> nexts;
+    std::vector<size_t> prevs;
+    std::vector<std::pair<TokenType, size_t>> heap;
+};
+
+thread_local EncoderScratch encoder_scratch;
+
+static TokenType find_pair_token(const dnabpe_model* model, TokenType a, TokenType b) {
+    auto it = model->pair_tokens.find(((uint64_t)a << 32) | b);
+    return it == model->pair_tokens.end() ? 0 : it->second;
+}
+
+static void push_candidate(const dnabpe_model* model, EncoderScratch& scratch, size_t i) {
+    size_t j = scratch.nexts[i];
+    if (j >= scratch.tokens.size()) {
+        return;
+    }
+    TokenType token = find_pair_token(model, scratch.tokens[i], scratch.tokens[j]);
+    if (token) {
+        scratch.heap.emplace_back(token, i);
+        std::push_heap(scratch.heap.begin(), scratch.heap.end(), std::greater<std::pair<TokenType, size_t>>());
+    }
+}
+
+// encodes one sequence into ids and returns the number of tokens
+static size_t encode_sequence(const dnabpe_model* model, const char* seq, size_t length, uint32_t* ids) {
+    EncoderScratch& scratch = encoder_scratch;
+    scratch.tokens.resize(length);
+    scratch.nexts.resize(length);
+    scratch.prevs.resize(length);
+    scratch.heap.clear();
+    for (size_t i = 0; i < length; i++) {
+        scratch.tokens[i] = model->char_tokens[(unsigned char)seq[i]];
+        scratch.nexts[i] = i + 1;
+        scratch.prevs[i] = i == 0 ? length : i - 1; // length marks none
+    }
+    for (size_t i = 0; i + 1 < length; i++) {
+        push_candidate(model, scratch, i);
+    }
+
+    auto compare = std::greater<std::pair<TokenType, size_t>>();
+    while (!scratch.heap.empty()) {
+        std::pop_heap(scratch.heap.begin(), scratch.heap.end(), compare);
+        TokenType token = scratch.heap.back().first;
+        size_t i = scratch.heap.back().second;
+        scratch.heap.pop_back();
+        // the entry is stale if position i was merged away (token 0, [UNK],
+        // which is in no pair) or the pair at i has changed since
+        size_t j = scratch.nexts[i];
+        if (scratch.tokens[i] == 0 || j >= length || find_pair_token(model, scratch.tokens[i], scratch.tokens[j]) != token) {
+            continue;
+        }
+        scratch.tokens[i] = token;
+        scratch.tokens[j] = 0;
+        scratch.nexts[i] = scratch.nexts[j];
+        if (scratch.nexts[j] < length) {
+            scratch.prevs[scratch.nexts[j]] = i;
+        }
+        if (scratch.prevs[i] < length) {
+            push_candidate(model, scratch, scratch.prevs[i]);
+        }
+        push_candidate(model, scratch, i);
+    }
+
+    size_t n = 0;
+    for (size_t i = 0; i < length; i = scratch.nexts[i]) {
+        ids[n++] = scratch.tokens[i];
+    }
+    return n;
+}
+
+DNABPE_API dnabpe_model* dnabpe_load(const char* merges_file) {
+    std::ifstream file(merges_file);
+    if (!file.is_open()) {
+        return nullptr;
+    }
+    dnabpe_model* model = new dnabpe_model();
+    model->first_token = alphabet.size();
+    model->n_tokens = model->first_token;
+
+    std::vector<std::string> alphabet_strings(model->first_token);
+    for (const auto& element : alphabet) {
+        alphabet_strings[element.second] = element.first;
+    }
+    // input characters are read case-insensitively, anything else is [UNK]
+    model->char_tokens.assign(256, alphabet.at("[UNK]"));
+    for (const auto& element : alphabet) {
+        if (element.first.size() == 1) {
+            unsigned char c = element.first[0];
+            model->char_tokens[c] = element.second;
+            model->char_tokens[std::tolower(c)] = element.second;
+        }
+    }
+
+    std::vector<Kmer> pairs;
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream fields(line);
+        uint64_t token, a, b;
+        if (!(fields >> token >> a >> b) || token != model->n_tokens || a >= token || b >= token) {
+            delete model;
+            return nullptr;
+        }
+        model->pair_tokens[(a << 32) | b] = token;
+        pairs.emplace_back(a, b);
+        model->n_tokens++;
+    }
+
+    build_token_strings(alphabet_strings, pairs, model->token_strings);
+    model->vocab.n_tokens = model->n_tokens;
+    model->vocab.offsets = model->token_strings.offsets.data();
+    model->vocab.strings = model->token_strings.strings.data();
+    model->vocab.n_chars = model->token_strings.offsets[model->n_tokens];
+    model->can_encode = true;
+    return model;
+}
+
+DNABPE_API dnabpe_model* dnabpe_load_vocab(const char* vocab_file) {
+    dnabpe_model* model = new dnabpe_model();
+    if (!open_vocab_blob(vocab_file, model->vocab)) {
+        delete model;
+        return nullptr;
+    }
+    model->n_tokens = model->vocab.n_tokens;
+    return model;
+}
+
+DNABPE_API void dnabpe_free(dnabpe_model* model) {
+    if (model != nullptr) {
+        close_vocab_blob(model->vocab);
+    }
+    delete model;
+}
+
+DNABPE_API uint32_t dnabpe_vocab_size(const dnabpe_model* model) {
+    return model->n_tokens;
+}
+
+DNABPE_API size_t dnabpe_token_length(const dnabpe_model* model, uint32_t token) {
+    uint64_t start, length;
+    if (!get_token_span(model->vocab, token, start, length)) {
+        return 0;
+    }
+    return length;
+}
+
+DNABPE_API int64_t dnabpe_encode_batch(const dnabpe_model* model, const char* const* seqs, const size_t* lengths, size_t n,
+                                       uint32_t* ids, size_t capacity, uint64_t* offsets) {
+    if (!model->can_encode) {
+        return -1;
+    }
+    size_t total = 0;
+    for (size_t i = 0; i < n; i++) {
+        total += lengths[i];
+    }
+    if (total > capacity) {
+        return -1;
+    }
+    offsets[0] = 0;
+    for (size_t i = 0; i < n; i++) {
+        offsets[i + 1] = offsets[i] + encode_sequence(model, seqs[i], lengths[i], ids + offsets[i]);
+    }
+    return offsets[n];
+}
+
+DNABPE_API int64_t dnabpe_decode(const dnabpe_model* model, const uint32_t* ids, size_t n, char* out, size_t capacity) {
+    return decode_tokens(model->vocab, ids, n, out, capacity);
+}
@@ -0,0 +1,60 @@
+#ifndef DNABPE_FILE_H
+#define DNABPE_FILE_H
+
+/*
+ * C interface of libdnabpe: encodes sequences with a trained vocabulary and
+ * decodes token ids back to bases. A model is read-only once loaded, so all
+ * calls with the same model may run from many threads at once. Encoding and
+ * decoding write into buffers of the caller and reuse per-thread scratch
+ * memory, so they do not allocate once that has grown to the longest
+ * sequence seen by the thread.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct dnabpe_model dnabpe_model;
+
+/* loads the prefix.<n>.merges file written by training, NULL on error */
+dnabpe_model* dnabpe_load(const char* merges_file);
+
+/*
+ * maps the prefix.<n>.vocab.bin file written by training for decoding only,
+ * dnabpe_encode_batch fails with such a model; NULL on error
+ */
+dnabpe_model* dnabpe_load_vocab(const char* vocab_file);
+
+void dnabpe_free(dnabpe_model* model);
+
+/* number of tokens, alphabet included; token ids are below it */
+uint32_t dnabpe_vocab_size(const dnabpe_model* model);
+
+/* number of bases of a token, 0 for an unknown id */
+size_t dnabpe_token_length(const dnabpe_model* model, uint32_t token);
+
+/*
+ * Encodes n sequences, seqs[i] of lengths[i] bases (case does not matter,
+ * other characters become [UNK]). Token ids of sequence i are written to
+ * ids[offsets[i]:offsets[i + 1]], so offsets holds n + 1 elements. A sequence
+ * never has more tokens than bases, so capacity = sum of lengths is enough.
+ * Returns the number of ids written, or -1 if capacity is too small or the
+ * model was loaded with dnabpe_load_vocab.
+ */
+int64_t dnabpe_encode_batch(const dnabpe_model* model, const char* const* seqs, const size_t* lengths, size_t n,
+                            uint32_t* ids, size_t capacity, uint64_t* offsets);
+
+/*
+ * Writes the bases of n token ids to out. Returns the number of characters
+ * written, or -1 if capacity is too small or an id is not in the vocabulary.
+ */
+int64_t dnabpe_decode(const dnabpe_model* model, const uint32_t* ids, size_t n, char* out, size_t capacity);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
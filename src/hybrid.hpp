@@ -0,0 +1,94 @@
+#ifndef HYBRID_FILE_H
+#define HYBRID_FILE_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <iostream>
+
+#include "tokens.hpp"
+#include "container.hpp"
+#include "trainer.hpp"
+#include "lowmem.hpp"
+
+// Hybrid engine: early merges each replace a large share of the sequence and
+// run as streaming passes over the flat token array of LowMemEngine. Once the
+// most frequent pair occurs fewer than switch_tf times the SequenceContainer is
+// built from the already shorter sequence, and the sparse long tail of merges
+// walks its position lists. switch_tf 0 picks size / 32: about where a scan of
+// the whole array costs as much as following that many positions. The size
+// counts the n_compacted helper tokens that compact_helper_runs took out, so
+// that the switch does not move with the number of N in the input. Each phase
+// keeps the tie-breaking of its engine, the smaller pair before the switch and
+// the smaller kmer id after it, so the merges match neither lowmem nor fast
+// exactly once pairs of the same count come up.
+class HybridEngine {
+public:
+
+    HybridEngine(std::vector<TokenType>& seq, size_t n_threads, size_t switch_tf, size_t n_compacted = 0) : n_threads_(n_threads), switch_tf_(switch_tf), n_compacted_(n_compacted) {
+        lowmem_ = std::make_unique<LowMemEngine>(seq, n_threads);
+    }
+
+    std::pair<Kmer, size_t> get_most_frequent_pair() {
+        if (lowmem_) {
+            auto top = lowmem_->get_most_frequent_pair();
+            size_t switch_tf = switch_tf_ ? switch_tf_ : (lowmem_->size() + n_compacted_) / 32;
+            if (top.second >= switch_tf || top.second < 2) {
+                return top;
+            }
+            switch_to_container(top.second);
+        }
+        return fast_->get_most_frequent_pair();
+    }
+
+    void merge(const Kmer& kmer, TokenType L, Vocabulary& vocab) {
+        if (lowmem_) {
+            lowmem_->merge(kmer, L, vocab);
+        } else {
+            fast_->merge(kmer, L, vocab);
+        }
+    }
+
+    size_t size() {
+        return lowmem_ ? lowmem_->size() : fast_->size();
+    }
+
+    // counters of both phases
+    const ContainerStats& stats() {
+        const ContainerStats& current = lowmem_ ? lowmem_->stats() : fast_->stats();
+        stats_.positions_visited = before_switch_.positions_visited + current.positions_visited;
+        stats_.positions_live = before_switch_.positions_live + current.positions_live;
+        stats_.new_kmers = before_switch_.new_kmers + current.new_kmers;
+        stats_.stale_heap_pops = before_switch_.stale_heap_pops + current.stale_heap_pops;
+        return stats_;
+    }
+
+    std::vector<TokenType> get_as_vector() {
+        return lowmem_ ? lowmem_->get_as_vector() : fast_->get_as_vector();
+    }
+
+private:
+
+    void switch_to_container(size_t tf) {
+        auto start_time = std::chrono::high_resolution_clock::now();
+        std::cout << "Switching to SequenceContainer at tf " << tf << ", size " << lowmem_->size() << std::endl;
+        before_switch_ = lowmem_->stats();
+        std::vector<TokenType> seq = lowmem_->take_sequence();
+        lowmem_.reset();
+        // the sequence has many distinct pairs by now, position lists start small
+        fast_ = std::make_unique<FastEngine>(seq, n_threads_, 64);
+        auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - start_time).count();
+        std::cout << "Switching took " << duration << " ms" << std::endl;
+    }
+
+    size_t n_threads_;
+    size_t switch_tf_;
+    size_t n_compacted_;
+    std::unique_ptr<LowMemEngine> lowmem_;
+    std::unique_ptr<FastEngine> fast_;
+    ContainerStats before_switch_;
+    ContainerStats stats_;
+};
+
+#endif
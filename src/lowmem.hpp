@@ -0,0 +1,190 @@
+#ifndef LOWMEM_FILE_H
+#define LOWMEM_FILE_H
+
+#include <string>
+#include <vector>
+#include <queue>
+#include <thread>
+#include <algorithm>
+#include <unordered_map>
+
+#include "tokens.hpp"
+#include "container.hpp"
+#include "trainer.hpp"
+#include "output.hpp"
+#include "replace.hpp"
+
+// Low-memory engine: the sequence is a flat array of tokens, 4 bytes per
+// token, without prev/next links or position lists. Pair counts are kept in a
+// hash map and updated from the deltas of each replacement pass, and the most
+// frequent pair comes from a lazy max-heap, so a merge costs one scan of the
+// tokens (replace.hpp) and no recount. Ties are broken by the smaller pair.
+class LowMemEngine {
+public:
+
+    LowMemEngine(std::vector<TokenType>& seq, size_t n_threads) : n_threads_(n_threads) {
+        seq_.swap(seq);
+        count_pairs(n_threads);
+        for (const auto& element : counts_) {
+            heap_.push(std::make_pair(element.second, element.first));
+        }
+    }
+
+    std::pair<Kmer, size_t> get_most_frequent_pair() {
+        while (!heap_.empty()) {
+            auto top_entry = heap_.top();
+            auto it = counts_.find(top_entry.second);
+            if (it != counts_.end() && it->second == top_entry.first) {
+                return std::make_pair(get_pair_of_key(top_entry.second), top_entry.first);
+            }
+            heap_.pop();
+            stats_.stale_heap_pops++;
+        }
+        return std::make_pair(std::make_tuple(0, 0), 0);
+    }
+
+    // Replaces the pair (a, b) left to right, so in a run of a self-pair
+    // a a a a every other position is taken. Around each occurrence the pairs
+    // (x, a), (a, b), (b, y) are gone and (x, L), (L, y) are new; a neighbour
+    // that is itself a replaced occurrence is counted once, as (L, L). The
+    // deltas are taken from the neighbours of each occurrence as it is replaced.
+    void merge(const Kmer& kmer, TokenType L, Vocabulary& vocab) {
+        TokenType a = std::get<0>(kmer);
+        TokenType b = std::get<1>(kmer);
+        size_t n = seq_.size();
+        touched_.clear();
+        size_t n_replaced = replace_pair(seq_, a, b, L, n_threads_, [&](const PairNeighbours& o) {
+            update(a, b, -1);
+            if (o.has_left && !o.left_replaced) {
+                update(o.left, a, -1);
+            }
+            if (o.has_right) {
+                update(b, o.right, -1);
+            }
+            if (o.has_left) {
+                update(o.left, L, 1); // left is L after a replaced occurrence
+            }
+            if (o.has_right && !o.right_replaced) {
+                update(L, o.right, 1);
+            }
+        });
+        stats_.positions_visited += n;
+        stats_.positions_live += n_replaced;
+        push_touched();
+    }
+
+    size_t size() {
+        return seq_.size();
+    }
+
+    void get_pair_counts(PairCounts& counts) {
+        for (const auto& element : counts_) {
+            counts.emplace_back(element.first, element.second);
+        }
+    }
+
+    // merge appends every count change to log, nullptr stops it
+    void log_pair_deltas(PairCounts* log) {
+        delta_log_ = log;
+    }
+
+    const ContainerStats& stats() const {
+        return stats_;
+    }
+
+    std::vector<TokenType> get_as_vector() {
+        return seq_;
+    }
+
+    // hands the sequence over, the engine is empty afterwards
+    std::vector<TokenType> take_sequence() {
+        std::vector<TokenType> seq;
+        seq.swap(seq_);
+        return seq;
+    }
+
+private:
+
+    // pairs with a helper token are never merged and not counted
+    void update(TokenType a, TokenType b, int delta) {
+        if (a <= N_HELP_TOKENS || b <= N_HELP_TOKENS) {
+            return;
+        }
+        uint64_t key = get_pair_key(a, b);
+        auto it = counts_.find(key);
+        if (it == counts_.end()) {
+            it = counts_.emplace(key, 0).first;
+            stats_.new_kmers++;
+        }
+        it->second += delta;
+        touched_.push_back(key);
+        if (delta_log_ != nullptr) {
+            delta_log_->emplace_back(key, delta);
+        }
+    }
+
+    // pairs whose count changed get a fresh heap entry, the old ones go stale
+    void push_touched() {
+        std::sort(touched_.begin(), touched_.end());
+        touched_.erase(std::unique(touched_.begin(), touched_.end()), touched_.end());
+        for (uint64_t key : touched_) {
+            auto it = counts_.find(key);
+            if (it->second == 0) {
+                counts_.erase(it);
+            } else if (it->second > 1) {
+                heap_.push(std::make_pair(it->second, key));
+            }
+        }
+    }
+
+    void count_pairs(size_t n_threads) {
+        if (seq_.size() < 2) {
+            return;
+        }
+        size_t n_pairs = seq_.size() - 1;
+        n_threads = std::max((size_t)1, std::min(n_threads, n_pairs));
+        std::vector<std::unordered_map<uint64_t, size_t>> thread_counts(n_threads);
+        std::vector<std::thread> threads;
+        size_t chunk_size = n_pairs / n_threads;
+        for (size_t t = 0; t < n_threads; t++) {
+            size_t start = t * chunk_size;
+            size_t end = t == n_threads - 1 ? n_pairs : start + chunk_size;
+            threads.emplace_back([this, &thread_counts, t, start, end]() {
+                auto& local = thread_counts[t];
+                for (size_t i = start; i < end; i++) {
+                    if (seq_[i] > N_HELP_TOKENS && seq_[i + 1] > N_HELP_TOKENS) {
+                        local[get_pair_key(seq_[i], seq_[i + 1])]++;
+                    }
+                }
+            });
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+        counts_.swap(thread_counts[0]);
+        for (size_t t = 1; t < n_threads; t++) {
+            for (const auto& element : thread_counts[t]) {
+                counts_[element.first] += element.second;
+            }
+        }
+    }
+
+    struct CompareCount {
+        bool operator()(const std::pair<size_t, uint64_t>& a, const std::pair<size_t, uint64_t>& b) const {
+            if (a.first != b.first) {
+                return a.first < b.first; // larger count first
+            }
+            return a.second > b.second; // then the smaller pair
+        }
+    };
+
+    std::vector<TokenType> seq_;
+    std::unordered_map<uint64_t, size_t> counts_;
+    std::priority_queue<std::pair<size_t, uint64_t>, std::vector<std::pair<size_t, uint64_t>>, CompareCount> heap_;
+    std::vector<uint64_t> touched_;
+    size_t n_threads_;
+    ContainerStats stats_;
+    PairCounts* delta_log_ = nullptr;
+};
+
+#endif
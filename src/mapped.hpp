@@ -0,0 +1,193 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <string>
+#include <map>
+#include <mutex>
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "metrics.hpp"
+
+// Out-of-core mode: the large arrays of SequenceContainer (tokens, prevs,
+// nexts and long position lists) live in files mapped into memory instead of
+// on the heap, so the page cache holds what fits and the rest stays on disk.
+// Files are unlinked right after mapping and vanish with the process. When a
+// RAM budget is given, resident pages of the mappings are dropped whenever the
+// resident set grows over it; dirty pages stay in the page cache and are
+// written back by the kernel.
+struct OutOfCore {
+    std::string dir; // empty: everything is on the heap
+    size_t ram_budget_kb = 0; // 0: no limit
+    size_t min_mapped_bytes = 1 << 20; // smaller arrays stay on the heap
+    size_t n_files = 0;
+    size_t n_trims = 0;
+    std::map<void*, size_t> mapped; // address -> bytes
+    std::mutex mutex;
+};
+
+OutOfCore out_of_core;
+
+void enable_out_of_core(const std::string& dir, size_t ram_budget_kb) {
+    out_of_core.dir = dir;
+    out_of_core.ram_budget_kb = ram_budget_kb;
+}
+
+bool is_out_of_core() {
+    return !out_of_core.dir.empty();
+}
+
+// n zero-initialized elements, file-backed in out-of-core mode
+template<typename T>
+T* allocate_array(size_t n) {
+    size_t bytes = n * sizeof(T);
+    if (!is_out_of_core() || bytes < out_of_core.min_mapped_bytes) {
+        return new T[n]();
+    }
+    std::lock_guard<std::mutex> lock(out_of_core.mutex);
+    std::string file_name = out_of_core.dir + "/dnabpe." + std::to_string(getpid()) + "." + std::to_string(out_of_core.n_files++) + ".bin";
+    int fd = open(file_name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        std::cerr << "Error: Could not create file " << file_name << std::endl;
+        exit(1);
+    }
+    // a fresh file reads as zeros, so the array needs no initialization
+    if (ftruncate(fd, bytes) != 0) {
+        std::cerr << "Error: Could not allocate " << bytes << " bytes in " << file_name << std::endl;
+        exit(1);
+    }
+    void* address = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    unlink(file_name.c_str());
+    if (address == MAP_FAILED) {
+        std::cerr << "Error: Could not map " << file_name << std::endl;
+        exit(1);
+    }
+    out_of_core.mapped[address] = bytes;
+    return static_cast<T*>(address);
+}
+
+template<typename T>
+void free_array(T* array) {
+    if (array == nullptr) {
+        return;
+    }
+    // without out-of-core mode nothing is mapped, frees take no lock
+    if (!is_out_of_core()) {
+        delete[] array;
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(out_of_core.mutex);
+        auto it = out_of_core.mapped.find(array);
+        if (it != out_of_core.mapped.end()) {
+            munmap(array, it->second);
+            out_of_core.mapped.erase(it);
+            return;
+        }
+    }
+    delete[] array;
+}
+
+// Growable array on allocate_array, for buffers that are built by appending
+// but may get as large as the container arrays (packed position lists): past
+// min_mapped_bytes it is file-backed in out-of-core mode like them. Growing
+// copies into a new array of twice the capacity.
+template<typename T>
+class MappedVector {
+public:
+
+    MappedVector() = default;
+
+    MappedVector(const MappedVector& other) {
+        reserve(other.size_);
+        if (other.size_) {
+            memcpy(data_, other.data_, other.size_ * sizeof(T));
+        }
+        size_ = other.size_;
+    }
+
+    MappedVector& operator=(const MappedVector&) = delete;
+
+    ~MappedVector() {
+        free_array(data_);
+    }
+
+    void push_back(T value) {
+        if (size_ == capacity_) {
+            reserve(std::max(capacity_ * 2, (size_t)16));
+        }
+        data_[size_++] = value;
+    }
+
+    void reserve(size_t capacity) {
+        if (capacity > capacity_) {
+            reallocate(capacity);
+        }
+    }
+
+    void shrink_to_fit() {
+        if (capacity_ > size_) {
+            reallocate(size_);
+        }
+    }
+
+    const T* data() const {
+        return data_;
+    }
+
+    const T& operator[](size_t i) const {
+        return data_[i];
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    size_t capacity() const {
+        return capacity_;
+    }
+
+private:
+
+    void reallocate(size_t capacity) {
+        T* data = capacity ? allocate_array<T>(capacity) : nullptr;
+        if (size_) {
+            memcpy(data, data_, size_ * sizeof(T));
+        }
+        free_array(data_);
+        data_ = data;
+        capacity_ = capacity;
+    }
+
+    T* data_ = nullptr;
+    size_t size_ = 0;
+    size_t capacity_ = 0;
+};
+
+// Drops the resident pages of all mappings if the process is over the budget.
+// MADV_DONTNEED loses nothing here only because every mapping in
+// out_of_core.mapped is a MAP_SHARED mapping of a file: the pages leave the
+// process but stay in the page cache, dirty ones are written back to the file
+// by the kernel and read again on the next access. On a private or anonymous
+// mapping it would discard the data, so nothing else may be added to mapped.
+void trim_to_budget() {
+    if (!is_out_of_core() || out_of_core.ram_budget_kb == 0) {
+        return;
+    }
+    if (get_rss_kb() <= out_of_core.ram_budget_kb) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(out_of_core.mutex);
+    for (const auto& element : out_of_core.mapped) {
+        madvise(element.first, element.second, MADV_DONTNEED);
+    }
+    out_of_core.n_trims++;
+}
+
+#endif
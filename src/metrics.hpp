@@ -0,0 +1,135 @@
+#ifndef METRICS_FILE_H
+#define METRICS_FILE_H
+
+#include <string>
+#include <fstream>
+#include <iostream>
+#include <chrono>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "tokens.hpp"
+
+// current resident set size in kB, from /proc/self/statm
+size_t get_rss_kb() {
+    std::ifstream statm("/proc/self/statm");
+    size_t total_pages = 0;
+    size_t resident_pages = 0;
+    statm >> total_pages >> resident_pages;
+    return resident_pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// peak resident set size in kB
+size_t get_peak_rss_kb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// What the merge loop did for one merge.
+struct MergeMetrics {
+    TokenType token = 0;
+    TokenType a = 0;
+    TokenType b = 0;
+    size_t tf = 0;
+    size_t token_length = 0;
+    size_t size = 0;              // live pairs in the container after the merge
+    size_t positions_visited = 0; // entries of the position list walked by collapse
+    size_t positions_live = 0;    // of them still holding the pair, i.e. replaced
+    size_t stale_heap_pops = 0;   // outdated heap entries dropped to find the pair
+    size_t new_kmers = 0;         // kmers first seen during collapse
+    size_t collapse_us = 0;
+};
+
+// Machine-readable log of a training run, one JSON object per line. Merges are
+// summed in batches of `every`; a batch line has the pair, tf and size of its
+// last merge and the totals of the counters.
+class MetricsLog {
+public:
+
+    MetricsLog() {}
+
+    void open(const std::string& file_name, size_t every) {
+        out_.open(file_name);
+        if (!out_.is_open()) {
+            std::cerr << "Error: Could not open file " << file_name << std::endl;
+            exit(1);
+        }
+        every_ = every ? every : 1;
+        start_time_ = std::chrono::steady_clock::now();
+    }
+
+    bool is_open() const {
+        return out_.is_open();
+    }
+
+    void event(const std::string& name, size_t duration_ms, size_t size) {
+        if (!is_open()) {
+            return;
+        }
+        out_ << "{\"event\":\"" << name << "\",\"duration_ms\":" << duration_ms << ",\"size\":" << size
+             << ",\"elapsed_ms\":" << elapsed_ms() << ",\"rss_kb\":" << get_rss_kb() << ",\"peak_rss_kb\":" << get_peak_rss_kb() << "}\n";
+    }
+
+    void add(const MergeMetrics& merge) {
+        if (!is_open()) {
+            return;
+        }
+        if (n_merges_ == 0) {
+            batch_ = merge;
+        } else {
+            batch_.token = merge.token;
+            batch_.a = merge.a;
+            batch_.b = merge.b;
+            batch_.tf = merge.tf;
+            batch_.token_length = merge.token_length;
+            batch_.size = merge.size;
+            batch_.positions_visited += merge.positions_visited;
+            batch_.positions_live += merge.positions_live;
+            batch_.stale_heap_pops += merge.stale_heap_pops;
+            batch_.new_kmers += merge.new_kmers;
+            batch_.collapse_us += merge.collapse_us;
+        }
+        n_merges_++;
+        if (n_merges_ == every_) {
+            flush();
+        }
+    }
+
+    void close() {
+        if (!is_open()) {
+            return;
+        }
+        flush();
+        out_.close();
+    }
+
+private:
+
+    size_t elapsed_ms() {
+        auto now = std::chrono::steady_clock::now();
+        return std::chrono::duration_cast<std::chrono::milliseconds>(now - start_time_).count();
+    }
+
+    void flush() {
+        if (n_merges_ == 0) {
+            return;
+        }
+        out_ << "{\"event\":\"merge\",\"token\":" << batch_.token << ",\"merges\":" << n_merges_
+             << ",\"a\":" << batch_.a << ",\"b\":" << batch_.b << ",\"tf\":" << batch_.tf
+             << ",\"token_length\":" << batch_.token_length << ",\"size\":" << batch_.size
+             << ",\"positions_visited\":" << batch_.positions_visited << ",\"positions_live\":" << batch_.positions_live
+             << ",\"stale_heap_pops\":" << batch_.stale_heap_pops << ",\"new_kmers\":" << batch_.new_kmers
+             << ",\"collapse_us\":" << batch_.collapse_us << ",\"elapsed_ms\":" << elapsed_ms()
+             << ",\"rss_kb\":" << get_rss_kb() << "}\n";
+        n_merges_ = 0;
+    }
+
+    std::ofstream out_;
+    size_t every_ = 1;
+    size_t n_merges_ = 0;
+    MergeMetrics batch_;
+    std::chrono::steady_clock::time_point start_time_;
+};
+
+#endif
@@ -0,0 +1,327 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+#include <filesystem>
+#include <memory>
+
+#include "tokens_model.hpp"
+#include "readers.hpp"
+#include "tokens.hpp"
+#include "preprocess.hpp"
+#include "core.hpp"
+#include "output.hpp"
+#include "container.hpp"
+#include "options.hpp"
+#include "trainer.hpp"
+#include "replace.hpp"
+#include "lowmem.hpp"
+#include "synthetic.hpp"
+
+// Microbenchmarks of the hot kernels on fixed-seed inputs. Every benchmark runs
+// an untimed setup before each repetition, so kernels that change their input
+// (collapse) always start from the same state. Warmup repetitions are dropped.
+
+using ordered_json = nlohmann::ordered_json;
+
+struct MicrobenchConfig {
+    size_t size = 1000000;
+    size_t reps = 10;
+    size_t warmup = 2;
+    size_t threads = 4;
+    size_t merges = 64; // merges done before the collapse benchmarks
+    std::string filter;
+    std::string json_file;
+    std::string work_dir = "bench_work/micro";
+};
+
+struct Summary {
+    std::string name;
+    size_t items = 0;
+    std::vector<double> samples_ms;
+};
+
+double percentile(const std::vector<double>& sorted, double p) {
+    size_t rank = std::ceil(p / 100.0 * sorted.size());
+    return sorted[std::min(sorted.size() - 1, rank ? rank - 1 : 0)];
+}
+
+class Microbench {
+public:
+
+    // reports go to out, while the progress output the kernels print to
+    // std::cout is collected and dropped in sink
+    Microbench(const MicrobenchConfig& config, std::ostream& out, std::ostringstream& sink) : config_(config), out_(out), sink_(sink) {}
+
+    // setup is not timed; items is the number of elements processed per run
+    void run(const std::string& name, size_t items, std::function<void()> setup, std::function<void()> body) {
+        if (!config_.filter.empty() && name.find(config_.filter) == std::string::npos) {
+            return;
+        }
+        Summary summary;
+        summary.name = name;
+        summary.items = items;
+        for (size_t rep = 0; rep < config_.warmup + config_.reps; rep++) {
+            sink_.str("");
+            setup();
+            auto start = std::chrono::steady_clock::now();
+            body();
+            auto end = std::chrono::steady_clock::now();
+            if (rep >= config_.warmup) {
+                summary.samples_ms.push_back(std::chrono::duration<double, std::milli>(end - start).count());
+            }
+        }
+        report(summary);
+    }
+
+    void save() {
+        if (config_.json_file.empty()) {
+            return;
+        }
+        std::ofstream out(config_.json_file);
+        out << std::setw(2) << results_ << std::endl;
+    }
+
+private:
+
+    void report(Summary& summary) {
+        std::vector<double> sorted = summary.samples_ms;
+        std::sort(sorted.begin(), sorted.end());
+        double mean = std::accumulate(sorted.begin(), sorted.end(), 0.0) / sorted.size();
+        double variance = 0;
+        for (double x : sorted) {
+            variance += (x - mean) * (x - mean);
+        }
+        double stddev = sorted.size() > 1 ? std::sqrt(variance / (sorted.size() - 1)) : 0.0;
+        double p50 = percentile(sorted, 50);
+        double items_per_sec = p50 > 0 ? summary.items / (p50 / 1000.0) : 0.0;
+
+        out_ << std::left << std::setw(32) << summary.name << std::right << std::fixed << std::setprecision(3)
+                  << " min " << std::setw(10) << sorted.front()
+                  << " p50 " << std::setw(10) << p50
+                  << " p90 " << std::setw(10) << percentile(sorted, 90)
+                  << " p99 " << std::setw(10) << percentile(sorted, 99)
+                  << " mean " << std::setw(10) << mean
+                  << " sd " << std::setw(8) << stddev << " ms"
+                  << std::setprecision(0) << " " << std::setw(12) << items_per_sec << " items/s" << std::endl;
+
+        results_.push_back({
+            {"name", summary.name},
+            {"items", summary.items},
+            {"reps", sorted.size()},
+            {"min_ms", sorted.front()},
+            {"p50_ms", p50},
+            {"p90_ms", percentile(sorted, 90)},
+            {"p99_ms", percentile(sorted, 99)},
+            {"max_ms", sorted.back()},
+            {"mean_ms", mean},
+            {"stddev_ms", stddev},
+            {"items_per_sec", items_per_sec}
+        });
+    }
+
+    MicrobenchConfig config_;
+    std::ostream& out_;
+    std::ostringstream& sink_;
+    ordered_json results_ = ordered_json::array();
+};
+
+// Trainer state after a number of merges, as in train() of trainer.hpp.
+template<typename Engine>
+struct TrainerState {
+    std::unique_ptr<Vocabulary> vocab;
+    std::unique_ptr<Engine> engine;
+
+    // the engine may take over seq
+    void init(std::vector<TokenType>& seq, size_t n_threads) {
+        engine.reset();
+        vocab = std::make_unique<Vocabulary>(alphabet);
+        engine = std::make_unique<Engine>(seq, n_threads);
+    }
+
+    // returns false when there is nothing left to merge
+    bool merge() {
+        Kmer rep;
+        size_t tf;
+        std::tie(rep, tf) = engine->get_most_frequent_pair();
+        if (tf < 2) {
+            return false;
+        }
+        TokenType L = vocab->add(rep, tf);
+        engine->merge(rep, L, *vocab);
+        return true;
+    }
+};
+
+int main(int argc, char* argv[]) {
+
+    MicrobenchConfig config;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--size") {
+            config.size = std::stoul(get_option_value(argc, argv, i));
+        } else if (arg == "--reps") {
+            config.reps = std::stoul(get_option_value(argc, argv, i));
+        } else if (arg == "--warmup") {
+            config.warmup = std::stoul(get_option_value(argc, argv, i));
+        } else if (arg == "--threads") {
+            config.threads = std::stoul(get_option_value(argc, argv, i));
+        } else if (arg == "--merges") {
+            config.merges = std::stoul(get_option_value(argc, argv, i));
+        } else if (arg == "--filter") {
+            config.filter = get_option_value(argc, argv, i);
+        } else if (arg == "--json") {
+            config.json_file = get_option_value(argc, argv, i);
+        } else if (arg == "--workdir") {
+            config.work_dir = get_option_value(argc, argv, i);
+        } else {
+            std::cerr << "Unknown option " << arg << std::endl;
+            std::cerr << "Usage: " << argv[0] << " [--size n] [--reps n] [--warmup n] [--threads n] [--merges n] [--filter name] [--json file] [--workdir dir]" << std::endl;
+            return 1;
+        }
+    }
+    if (config.reps == 0) {
+        config.reps = 1;
+    }
+    std::filesystem::create_directories(config.work_dir);
+
+    // fixed-seed inputs in all supported formats
+    SyntheticParams params;
+    params.size = config.size;
+    params.mode = "chromosome";
+    params.chromosomes = 4;
+    std::string fasta_file = config.work_dir + "/input.fa";
+    SyntheticGenome(params).write(fasta_file);
+    params.mode = "reads";
+    std::string reads_file = config.work_dir + "/input.reads";
+    SyntheticGenome(params).write(reads_file);
+    std::string fastq_file = config.work_dir + "/input.fastq";
+    {
+        std::ifstream in(reads_file);
+        std::ofstream out(fastq_file);
+        std::string line;
+        size_t n = 0;
+        while (std::getline(in, line)) {
+            out << "@read" << n++ << "\n" << line << "\n+\n" << std::string(line.size(), 'I') << "\n";
+        }
+    }
+    std::vector<std::string> seqs;
+    get_sequences_fasta(fasta_file, seqs);
+    std::vector<TokenType> seq = get_dataset(seqs, alphabet);
+
+    std::ostream out(std::cout.rdbuf());
+    std::ostringstream sink;
+    std::cout.rdbuf(sink.rdbuf());
+    auto noop = []() {};
+
+    Microbench bench(config, out, sink);
+    out << "size " << config.size << ", " << config.reps << " reps after " << config.warmup << " warmup, times in ms" << std::endl;
+
+    std::vector<std::string> read_seqs;
+    auto clear_reads = [&]() { read_seqs.clear(); read_seqs.shrink_to_fit(); };
+    bench.run("read_fasta", config.size, clear_reads, [&]() { get_sequences_fasta(fasta_file, read_seqs); });
+    bench.run("read_reads", config.size, clear_reads, [&]() { get_sequences_reads(reads_file, read_seqs); });
+    bench.run("read_fastq", config.size, clear_reads, [&]() { get_sequences_fastq(fastq_file, read_seqs); });
+
+    std::vector<TokenType> dataset;
+    bench.run("get_dataset", seq.size(), [&]() { dataset.clear(); dataset.shrink_to_fit(); }, [&]() { dataset = get_dataset(seqs, alphabet); });
+
+    // engines take over their input, so each run gets a fresh copy
+    std::vector<TokenType> input;
+    auto copy_input = [&]() { input = seq; };
+
+    TrainerState<FastEngine> state;
+    bench.run("init_single_thread", seq.size(), copy_input, [&]() { state.init(input, 1); });
+    bench.run("init_threads_" + std::to_string(config.threads), seq.size(), copy_input, [&]() { state.init(input, config.threads); });
+
+    // collapse of the next pair after a fixed number of merges
+    size_t collapse_items = 0;
+    auto prepare_merges = [&]() {
+        copy_input();
+        state.init(input, 1);
+        for (size_t i = 0; i < config.merges && state.merge(); i++) {
+        }
+        collapse_items = state.engine->size();
+    };
+    prepare_merges();
+    bench.run("collapse_after_" + std::to_string(config.merges), collapse_items, prepare_merges, [&]() { state.merge(); });
+
+    // lookup of the most frequent pair right after a collapse left stale heap entries
+    auto prepare_lookup = [&]() { prepare_merges(); state.merge(); };
+    bench.run("get_most_frequent_pair", 1, prepare_lookup, [&]() { state.engine->get_most_frequent_pair(); });
+
+    TrainerState<LowMemEngine> lowmem;
+    bench.run("lowmem_init", seq.size(), copy_input, [&]() { lowmem.init(input, config.threads); });
+    size_t lowmem_items = 0;
+    auto prepare_lowmem_merges = [&]() {
+        copy_input();
+        lowmem.init(input, 1);
+        for (size_t i = 0; i < config.merges && lowmem.merge(); i++) {
+        }
+        lowmem_items = lowmem.engine->size();
+    };
+    prepare_lowmem_merges();
+    bench.run("lowmem_merge_after_" + std::to_string(config.merges), lowmem_items, prepare_lowmem_merges, [&]() { lowmem.merge(); });
+    lowmem.engine.reset();
+
+    // pair scan of the array engines, vector compares against the plain loop
+    TokenType scan_a = seq[seq.size() / 2];
+    TokenType scan_b = seq[seq.size() / 2 + 1];
+    std::vector<size_t> scan_positions;
+    auto clear_scan = [&]() { scan_positions.clear(); };
+    bench.run("find_pair_scalar", seq.size(), clear_scan, [&]() { find_pair_scalar(seq.data(), 0, seq.size() - 1, scan_a, scan_b, scan_positions); });
+    bench.run("find_pair", seq.size(), clear_scan, [&]() { find_pair_range(seq.data(), 0, seq.size() - 1, scan_a, scan_b, scan_positions); });
+    bench.run("replace_pair", seq.size(), copy_input, [&]() { replace_pair(input, scan_a, scan_b, alphabet.size(), 1); });
+
+    const size_t n_positions = config.size;
+    PositionsContainer positions;
+    bench.run("positions_set", n_positions, [&]() { positions = PositionsContainer(1000); }, [&]() {
+        for (size_t i = 0; i < n_positions; i++) {
+            positions.set(i);
+        }
+    });
+    auto fill_positions = [&]() {
+        positions = PositionsContainer(n_positions);
+        for (size_t i = 0; i < n_positions; i++) {
+            positions.set(3 * i);
+        }
+    };
+    bench.run("positions_pack", n_positions, fill_positions, [&]() { positions.pack(); });
+    bench.run("positions_read", n_positions, noop, [&]() {
+        PositionsReader reader(positions);
+        size_t sum = 0;
+        for (size_t i = 0; i < n_positions; i++) {
+            sum += reader.next();
+        }
+        std::cout << sum;
+    });
+
+    // writers on the final state of a short training run
+    copy_input();
+    state.init(input, 1);
+    for (size_t i = 0; i < 4 * config.merges && state.merge(); i++) {
+    }
+    Vocabulary& vocab = *state.vocab;
+    std::vector<TokenType> raw_seq = state.engine->get_as_vector();
+    std::string prefix = config.work_dir + "/out";
+    bench.run("get_as_vector", raw_seq.size(), noop, [&]() { raw_seq = state.engine->get_as_vector(); });
+    TokenStrings token_strings;
+    bench.run("get_strings", vocab.L, noop, [&]() { vocab.get_strings(token_strings); });
+    bench.run("save_snapshot", raw_seq.size(), noop, [&]() {
+        save_snapshot(vocab.merged, vocab.first_token, raw_seq, token_strings, vocab.alphabet_tf_map, prefix, "micro", true);
+    });
+    bench.run("save_bpe_from_vector", raw_seq.size(), noop, [&]() {
+        save_bpe_from_vector(raw_seq, token_strings, prefix + ".bpe", prefix + ".raw.bpe");
+    });
+    bench.run("save_npy_encoding", raw_seq.size(), noop, [&]() { save_npy_encoding(raw_seq, vocab.L, prefix, "micro"); });
+
+    std::cout.rdbuf(out.rdbuf());
+    bench.save();
+    return 0;
+}
@@ -0,0 +1,176 @@
+#ifndef NPY_FILE_H
+#define NPY_FILE_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <cstdint>
+#include <type_traits>
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Minimal writer and reader for the NumPy .npy format (version 1.0), one-
+// dimensional little-endian unsigned arrays only. Files written here can be
+// opened with np.load(path, mmap_mode="r") without any parsing of the payload.
+
+template<typename T>
+std::string npy_dtype() {
+    static_assert(std::is_unsigned<T>::value, "only unsigned dtypes are supported");
+    return "<u" + std::to_string(sizeof(T));
+}
+
+template<typename T>
+T to_little_endian(T value) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    T result = 0;
+    for (size_t i = 0; i < sizeof(T); i++) {
+        result = (result << 8) | (value & 0xff);
+        value >>= 8;
+    }
+    return result;
+#else
+    return value;
+#endif
+}
+
+// the header is padded with spaces so that the payload starts at a 64-byte boundary
+void write_npy_header(std::ofstream& out, const std::string& dtype, size_t n) {
+    std::string header = "{'descr': '" + dtype + "', 'fortran_order': False, 'shape': (" + std::to_string(n) + ",), }";
+    const size_t preamble = 10; // magic (6) + version (2) + header length (2)
+    size_t total = preamble + header.size() + 1;
+    size_t padding = (64 - total % 64) % 64;
+    header.append(padding, ' ');
+    header.push_back('\n');
+
+    uint16_t header_len = header.size();
+    out.write("\x93NUMPY", 6);
+    out.put(1);
+    out.put(0);
+    out.put(header_len & 0xff);
+    out.put(header_len >> 8);
+    out.write(header.data(), header.size());
+}
+
+// Buffered writer for the payload: values are appended one by one and flushed
+// in large blocks, so the caller never needs a full copy of the array. Errors
+// do not exit, as the writer may run on a worker thread: they are kept in
+// error() and close() returns false, the caller reports them.
+template<typename T>
+class NpyWriter {
+public:
+
+    NpyWriter(const std::string& file_name, size_t n) : file_name_(file_name), expected_(n) {
+        out_.open(file_name, std::ios::binary);
+        if (!out_.is_open()) {
+            error_ = "Could not open file " + file_name;
+            return;
+        }
+        write_npy_header(out_, npy_dtype<T>(), n);
+        buffer_.reserve(buffer_size_);
+    }
+
+    void push(T value) {
+        buffer_.push_back(to_little_endian(value));
+        if (buffer_.size() == buffer_size_) {
+            flush();
+        }
+    }
+
+    bool close() {
+        flush();
+        if (out_.is_open()) {
+            out_.close();
+        }
+        if (error_.empty() && out_.fail()) {
+            error_ = "Could not write file " + file_name_;
+        }
+        if (error_.empty() && written_ != expected_) {
+            error_ = file_name_ + " expected " + std::to_string(expected_) + " values, written " + std::to_string(written_);
+        }
+        return error_.empty();
+    }
+
+    const std::string& error() const {
+        return error_;
+    }
+
+private:
+
+    void flush() {
+        if (error_.empty()) {
+            out_.write(reinterpret_cast<const char*>(buffer_.data()), buffer_.size() * sizeof(T));
+            written_ += buffer_.size();
+        }
+        buffer_.clear();
+    }
+
+    const size_t buffer_size_ = 1 << 20;
+    std::string file_name_;
+    std::ofstream out_;
+    std::vector<T> buffer_;
+    size_t expected_ = 0;
+    size_t written_ = 0;
+    std::string error_;
+};
+
+// A one-dimensional .npy array mapped read-only, the payload is used in place.
+struct NpyArray {
+    void* mapping = nullptr;
+    size_t bytes = 0;
+    std::string dtype; // like <u4
+    size_t n = 0;
+    const char* data = nullptr;
+};
+
+// false if the file cannot be read or is not a one-dimensional .npy array
+bool open_npy(const std::string& file_name, NpyArray& array) {
+    int fd = open(file_name.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 10) {
+        close(fd);
+        return false;
+    }
+    void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+    const unsigned char* data = static_cast<const unsigned char*>(mapping);
+    size_t header_len = data[8] | (data[9] << 8);
+    std::string header(reinterpret_cast<const char*>(data) + 10, std::min(header_len, (size_t)st.st_size - 10));
+    size_t descr = header.find("'descr': '");
+    size_t shape = header.find("'shape': (");
+    if (memcmp(data, "\x93NUMPY", 6) != 0 || data[6] != 1 || descr == std::string::npos || shape == std::string::npos) {
+        munmap(mapping, st.st_size);
+        return false;
+    }
+    descr += 10;
+    array.dtype = header.substr(descr, header.find('\'', descr) - descr);
+    array.n = std::stoul(header.substr(shape + 10));
+    size_t item_size = array.dtype.size() == 3 ? array.dtype[2] - '0' : 0;
+    if (10 + header_len + array.n * item_size != (size_t)st.st_size) {
+        munmap(mapping, st.st_size);
+        return false;
+    }
+    array.mapping = mapping;
+    array.bytes = st.st_size;
+    array.data = reinterpret_cast<const char*>(data) + 10 + header_len;
+    return true;
+}
+
+void close_npy(NpyArray& array) {
+    if (array.mapping != nullptr) {
+        munmap(array.mapping, array.bytes);
+    }
+    array = NpyArray();
+}
+
+#endif
@@ -0,0 +1,109 @@
+#ifndef OPTIONS_FILE_H
+#define OPTIONS_FILE_H
+
+#include <string>
+#include <iostream>
+#include <cstdlib>
+#include <set>
+#include <sstream>
+
+// Optional flags given after the positional arguments.
+struct Options {
+    std::string engine = "fast"; // fast (SequenceContainer), lowmem (flat token array) or hybrid
+    size_t switch_tf = 0; // hybrid: pair frequency below which SequenceContainer takes over, 0 for auto
+    size_t workers = 0; // train the input in this many shards, one worker process each
+    size_t local_shards = 0; // train the input in this many shards, one thread each
+    bool dedup = false; // train on unique records, each counted as often as it occurs
+    bool softmask = false; // leave soft-masked (lowercase) bases out of training
+    bool strand_canonical = false; // count pairs together with their reverse complement
+    bool npy = false; // write the encoding also as .tokens.npy + .offsets.npy
+    size_t shards = 0; // write the encoding as this many balanced .npy shards
+    std::set<size_t> snapshots; // smaller vocabulary sizes to derive outputs for
+    std::string ooc_dir; // out-of-core: directory for the file-backed container arrays
+    size_t ram_budget_mb = 0; // out-of-core: resident memory to stay under, 0 for no limit
+    std::string metrics_file; // JSON lines log of the merge loop
+    size_t metrics_every = 1; // merges summed per line of the metrics log
+};
+
+const std::string options_usage =
+    "Options:\n"
+    "  --engine <name>        fast (default), lowmem, slower but with a fraction of the memory,\n"
+    "                         or hybrid, lowmem for the frequent pairs and fast for the rest\n"
+    "  --switch-tf <n>        hybrid: switch to the fast engine below this pair frequency\n"
+    "  --workers <n>          train in n worker processes, each on a shard of the records\n"
+    "  --local-shards <n>     train in n shards of the records in this process, one thread\n"
+    "                         and container each, placed on the NUMA nodes in turn\n"
+    "  --dedup                train on unique records weighted by their number of copies;\n"
+    "                         outputs cover all records (fast engine only)\n"
+    "  --softmask             leave soft-masked (lowercase) bases out of training; they\n"
+    "                         are encoded as single bases\n"
+    "  --strand-canonical     count each pair with its reverse complement and merge both,\n"
+    "                         for a vocabulary of both strands from one (fast, lowmem)\n"
+    "  --ooc-dir <dir>        out-of-core: keep the large container arrays in files in dir\n"
+    "  --ram-budget <MB>      out-of-core: release mapped pages above this resident size\n"
+    "  --npy                  write the encoding as a NumPy token array with record offsets\n"
+    "  --shards <n>           write the encoding as n NumPy shards balanced by token count\n"
+    "  --snapshots <a,b,...>  also write outputs for these smaller vocabulary sizes\n"
+    "  --metrics <file>       write per-merge metrics of the training as JSON lines\n"
+    "  --metrics-every <n>    sum n merges per metrics line (default 1)\n";
+
+// returns the value following a flag or exits if it is missing
+std::string get_option_value(int argc, char* argv[], int& i) {
+    if (i + 1 >= argc) {
+        std::cerr << "Option " << argv[i] << " requires a value" << std::endl;
+        exit(1);
+    }
+    i++;
+    return argv[i];
+}
+
+Options parse_options(int argc, char* argv[], int first) {
+    Options options;
+    for (int i = first; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--engine") {
+            options.engine = get_option_value(argc, argv, i);
+            if (options.engine != "fast" && options.engine != "lowmem" && options.engine != "hybrid") {
+                std::cerr << "Engine must be either fast, lowmem or hybrid" << std::endl;
+                exit(1);
+            }
+        } else if (arg == "--switch-tf") {
+            options.switch_tf = std::stoul(get_option_value(argc, argv, i));
+        } else if (arg == "--workers") {
+            options.workers = std::stoul(get_option_value(argc, argv, i));
+        } else if (arg == "--local-shards") {
+            options.local_shards = std::stoul(get_option_value(argc, argv, i));
+        } else if (arg == "--dedup") {
+            options.dedup = true;
+        } else if (arg == "--softmask") {
+            options.softmask = true;
+        } else if (arg == "--strand-canonical") {
+            options.strand_canonical = true;
+        } else if (arg == "--ooc-dir") {
+            options.ooc_dir = get_option_value(argc, argv, i);
+        } else if (arg == "--ram-budget") {
+            options.ram_budget_mb = std::stoul(get_option_value(argc, argv, i));
+        } else if (arg == "--npy") {
+            options.npy = true;
+        } else if (arg == "--shards") {
+            options.shards = std::stoul(get_option_value(argc, argv, i));
+        } else if (arg == "--metrics") {
+            options.metrics_file = get_option_value(argc, argv, i);
+        } else if (arg == "--metrics-every") {
+            options.metrics_every = std::stoul(get_option_value(argc, argv, i));
+        } else if (arg == "--snapshots") {
+            std::stringstream values(get_option_value(argc, argv, i));
+            std::string value;
+            while (std::getline(values, value, ',')) {
+                options.snapshots.insert(std::stoul(value));
+            }
+        } else {
+            std::cerr << "Unknown option " << arg << std::endl;
+            std::cerr << options_usage;
+            exit(1);
+        }
+    }
+    return options;
+}
+
+#endif
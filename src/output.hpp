@@ -4,24 +4,32 @@
 #include <string>
 #include <map>
 #include <vector>
+#include <unordered_map>
 #include <fstream>
 #include <iostream>
 #include <string>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+#include <filesystem>
 
 #include "tokens.hpp"
 #include "tokens_model.hpp"
+#include "npy.hpp"
+#include "decoder.hpp"
 
 #include "../nlohmann/json.hpp"
 
 using json = nlohmann::json;
 
+// token ids are assigned in merge order, merged[i] is the pair of token first_token + i
 void save_snapshot(
-        const std::unordered_map<TokenType, size_t>& tokens, 
-        std::vector<Kmer>& merged, 
-        std::unordered_map<Kmer, size_t, TupleHash> kmer2kmer_id, 
-        std::unordered_map<size_t, TokenType> rev_tokens, 
+        const std::vector<Kmer>& merged, 
+        TokenType first_token, 
         const std::vector<TokenType>& seq, 
-        const std::unordered_map<TokenType, std::string>& alphabet_map, std::unordered_map<TokenType, size_t>& alphabet_tf_map, 
+        const TokenStrings& token_strings, const std::vector<size_t>& alphabet_tf_map, 
         const std::string& output_prefix, 
         std::string n_tokens_suffix,
         bool save_seq=false
@@ -29,15 +37,28 @@ void save_snapshot(
 
     std::string output_poses_file = output_prefix + "." + n_tokens_suffix + ".poses";
     std::string output_model_file = output_prefix + "." + n_tokens_suffix + ".json";
+    std::string output_merges_file = output_prefix + "." + n_tokens_suffix + ".merges";
 
-    std::unordered_map<std::string, std::vector<std::pair<size_t, size_t>>> kmer2poses;
-    std::unordered_map<std::string, size_t> kmer2tf;
-    
-    // init kmer2poses with empty vectors and keys from alphabet_map
-    for (const auto& element : alphabet_map) {
-        kmer2poses[element.second] = std::vector<std::pair<size_t, size_t>>();
-        kmer2tf[element.second] = 0;
+    // the merges alone, token and its pair per line, are the model that
+    // libdnabpe encodes new sequences with
+    std::ofstream merges_file(output_merges_file);
+    for (size_t i = 0; i < merged.size(); i++) {
+        merges_file << first_token + i << "\t" << std::get<0>(merged[i]) << "\t" << std::get<1>(merged[i]) << "\n";
     }
+    merges_file.close();
+    save_vocab_blob(output_prefix + "." + n_tokens_suffix + ".vocab.bin", token_strings, first_token + merged.size());
+
+    // tokens with the same string share positions and counts; each token is
+    // mapped once to the first token with its string, so the pass over seq
+    // below indexes vectors instead of hashing strings
+    std::vector<TokenType> string_ids(token_strings.size());
+    std::unordered_map<std::string_view, TokenType> first_with_string;
+    for (TokenType token = 0; token < token_strings.size(); token++) {
+        string_ids[token] = first_with_string.emplace(token_strings.at(token), token).first->second;
+    }
+    first_with_string.clear();
+    std::vector<std::vector<std::pair<size_t, size_t>>> kmer2poses(token_strings.size());
+    std::vector<size_t> kmer2tf(token_strings.size(), 0);
 
     size_t pos = 0;
     size_t seqid = 0;
@@ -46,24 +67,25 @@ void save_snapshot(
             seqid += 1;
             pos = 0;
         } else {
-            std::string token_string = alphabet_map.at(element);
-            kmer2poses.at(token_string).emplace_back(std::make_pair(seqid, pos));
-            kmer2tf.at(token_string) += 1;
-            pos += token_string.size();
+            TokenType string_id = string_ids.at(element);
+            kmer2poses[string_id].emplace_back(std::make_pair(seqid, pos));
+            kmer2tf[string_id] += 1;
+            pos += token_strings.at(element).size();
         }
     }
 
     std::ofstream poses_file(output_poses_file);
     // write poses to file and add the secone argument tf from kmer2tf
-    for (const Kmer& kmer_ : merged) {
-        size_t kmer_id = kmer2kmer_id.at(kmer_);
-        TokenType token = rev_tokens[kmer_id];
-        std::string kmer_seq = alphabet_map.at(token);
-        // if (save_seq && kmer2tf.at(kmer_seq) == 0) {
+    for (size_t i = 0; i < merged.size(); i++) {
+        const Kmer& kmer_ = merged[i];
+        TokenType token = first_token + i;
+        std::string_view kmer_seq = token_strings.at(token);
+        TokenType string_id = string_ids[token];
+        // if (save_seq && kmer2tf[string_id] == 0) {
         //     continue;
         // }
-        poses_file << token << "\t" << kmer_seq << "\t" << std::get<0>(kmer_) << ":" << std::get<1>(kmer_) << "\t" << alphabet_tf_map.at(token) << "\t" << kmer2tf.at(kmer_seq) << "\t";
-        for (const auto& pos : kmer2poses.at(kmer_seq)) {
+        poses_file << token << "\t" << kmer_seq << "\t" << std::get<0>(kmer_) << ":" << std::get<1>(kmer_) << "\t" << alphabet_tf_map.at(token) << "\t" << kmer2tf[string_id] << "\t";
+        for (const auto& pos : kmer2poses[string_id]) {
             poses_file << pos.first << ":" << pos.second << " ";
         }
         poses_file << std::endl;
@@ -77,4 +99,245 @@ void save_snapshot(
     // configFile.close();
 }
 
+// Text encodings of a token sequence: token strings in prefix.bpe and token ids
+// in prefix.raw.bpe, space separated, one sequence per line. A separator that
+// closes an empty record is written out, so an empty record is a ~ (5) line.
+void save_bpe_from_vector(const std::vector<TokenType>& seq, const TokenStrings& token_strings, const std::string& output_bpe_encoding_file, const std::string& output_bpe_raw_encoding_file) {
+    std::ofstream out_file(output_bpe_encoding_file);
+    std::ofstream out_raw_file(output_bpe_raw_encoding_file);
+    bool first = true;
+    bool after_separator = false;
+    for (size_t i = 0; i < seq.size(); i++) {
+        const TokenType element = seq[i];
+        if (element == 5) {
+            if (after_separator) {
+                out_file << token_strings.at(element);
+                out_raw_file << element;
+            }
+            if (i > 0) {
+                out_file << "\n";
+                out_raw_file << "\n";
+            }
+            first = true;
+            after_separator = true;
+            continue;
+        }
+        after_separator = false;
+        if (!first) {
+            out_file << " ";
+            out_raw_file << " ";
+        }
+        out_file << token_strings.at(element);
+        out_raw_file << element;
+        first = false;
+    }
+    out_file.close();
+    out_raw_file.close();
+}
+
+// Since merges are nested, the encoding with a smaller vocabulary is obtained
+// by splitting every token whose id is not below vocab_size back into the pair
+// it was merged from. Token ids are assigned in merge order, so token t was
+// created by merge rank t - first_token and merged[t - first_token] is its pair.
+std::vector<TokenType> decompose_to_vocab(const std::vector<TokenType>& seq, const std::vector<Kmer>& merged, TokenType first_token, TokenType vocab_size) {
+    std::vector<TokenType> result;
+    result.reserve(seq.size());
+    std::vector<TokenType> stack;
+    for (const TokenType& element : seq) {
+        if (element < vocab_size) {
+            result.push_back(element);
+            continue;
+        }
+        stack.push_back(element);
+        while (!stack.empty()) {
+            TokenType token = stack.back();
+            stack.pop_back();
+            if (token < vocab_size) {
+                result.push_back(token);
+                continue;
+            }
+            const Kmer& kmer = merged[token - first_token];
+            // right first so that the left part is emitted first
+            stack.push_back(std::get<1>(kmer));
+            stack.push_back(std::get<0>(kmer));
+        }
+    }
+    return result;
+}
+
+// Split the encoded sequence into records at the ~ separators.
+// Returns indexes of the first token of each record plus the end of the last one.
+std::vector<size_t> get_record_bounds(const std::vector<TokenType>& seq) {
+    std::vector<size_t> bounds;
+    bounds.push_back(0);
+    for (size_t i = 0; i < seq.size(); i++) {
+        if (seq[i] == 5) {
+            bounds.push_back(i + 1);
+        }
+    }
+    if (bounds.back() != seq.size()) {
+        bounds.push_back(seq.size());
+    }
+    return bounds;
+}
+
+// Write records [first_record, last_record) as a packed token array and a
+// companion offsets array: record r occupies tokens [offsets[r], offsets[r+1]).
+// The ~ separators are not written. Returns the number of tokens, or sets
+// error and returns 0 when a file cannot be written; it does not exit, so it
+// can run on a worker thread.
+template<typename T>
+size_t write_npy_records(const std::vector<TokenType>& seq, const std::vector<size_t>& bounds, size_t first_record, size_t last_record, const std::string& tokens_file, const std::string& offsets_file, std::string& error) {
+
+    size_t n_tokens = 0;
+    for (size_t r = first_record; r < last_record; r++) {
+        for (size_t i = bounds[r]; i < bounds[r + 1]; i++) {
+            if (seq[i] != 5) {
+                n_tokens++;
+            }
+        }
+    }
+
+    NpyWriter<T> tokens_out(tokens_file, n_tokens);
+    NpyWriter<uint64_t> offsets_out(offsets_file, last_record - first_record + 1);
+    size_t offset = 0;
+    for (size_t r = first_record; r < last_record; r++) {
+        offsets_out.push(offset);
+        for (size_t i = bounds[r]; i < bounds[r + 1]; i++) {
+            if (seq[i] != 5) {
+                tokens_out.push(seq[i]);
+                offset++;
+            }
+        }
+    }
+    offsets_out.push(offset);
+    if (!tokens_out.close()) {
+        error = tokens_out.error();
+        return 0;
+    }
+    if (!offsets_out.close()) {
+        error = offsets_out.error();
+        return 0;
+    }
+    return n_tokens;
+}
+
+// uint16 is enough while every token id is below 65536
+bool npy_fits_uint16(TokenType L) {
+    return L <= 65536;
+}
+
+void save_npy_encoding(const std::vector<TokenType>& seq, TokenType L, const std::string& output_prefix, std::string n_tokens_suffix) {
+
+    std::string tokens_file = output_prefix + "." + n_tokens_suffix + ".tokens.npy";
+    std::string offsets_file = output_prefix + "." + n_tokens_suffix + ".offsets.npy";
+
+    std::vector<size_t> bounds = get_record_bounds(seq);
+    size_t n_records = bounds.size() - 1;
+    size_t n_tokens;
+    std::string error;
+    if (npy_fits_uint16(L)) {
+        n_tokens = write_npy_records<uint16_t>(seq, bounds, 0, n_records, tokens_file, offsets_file, error);
+    } else {
+        n_tokens = write_npy_records<uint32_t>(seq, bounds, 0, n_records, tokens_file, offsets_file, error);
+    }
+    if (!error.empty()) {
+        std::cerr << "Error: " << error << std::endl;
+        exit(1);
+    }
+    std::cout << "Saved " << n_tokens << " tokens of " << n_records << " records to " << tokens_file << std::endl;
+}
+
+// Split records into n_shards contiguous ranges with about the same number of
+// tokens. Returns n_shards + 1 record indexes.
+std::vector<size_t> get_shard_bounds(const std::vector<TokenType>& seq, const std::vector<size_t>& bounds, size_t n_shards) {
+    size_t n_records = bounds.size() - 1;
+    std::vector<size_t> cumulative(n_records + 1, 0);
+    for (size_t r = 0; r < n_records; r++) {
+        size_t n = bounds[r + 1] - bounds[r];
+        if (n && seq[bounds[r + 1] - 1] == 5) {
+            n--;
+        }
+        cumulative[r + 1] = cumulative[r] + n;
+    }
+    std::vector<size_t> shard_bounds(n_shards + 1, n_records);
+    shard_bounds[0] = 0;
+    for (size_t k = 1; k < n_shards; k++) {
+        size_t target = cumulative[n_records] * k / n_shards;
+        size_t r = std::lower_bound(cumulative.begin(), cumulative.end(), target) - cumulative.begin();
+        // cut before the record that crosses the target if that is closer
+        if (r > 0 && r <= n_records && target - cumulative[r - 1] < cumulative[r] - target) {
+            r--;
+        }
+        shard_bounds[k] = std::max(shard_bounds[k - 1], std::min(r, n_records));
+    }
+    return shard_bounds;
+}
+
+std::string get_shard_name(const std::string& output_prefix, std::string n_tokens_suffix, size_t shard, size_t n_shards) {
+    std::ostringstream name;
+    name << output_prefix << "." << n_tokens_suffix << ".shard-" << std::setw(5) << std::setfill('0') << shard << "-of-" << std::setw(5) << std::setfill('0') << n_shards;
+    return name.str();
+}
+
+// Write the encoding as n_shards token/offset array pairs balanced by token
+// count, in parallel, plus a prefix.L.shards.json manifest describing them.
+void save_sharded_encoding(const std::vector<TokenType>& seq, TokenType L, const std::string& output_prefix, std::string n_tokens_suffix, size_t n_shards, size_t n_threads) {
+
+    std::vector<size_t> bounds = get_record_bounds(seq);
+    std::vector<size_t> shard_bounds = get_shard_bounds(seq, bounds, n_shards);
+    std::vector<size_t> shard_tokens(n_shards, 0);
+    std::vector<std::string> shard_errors(n_shards);
+    bool is_uint16 = npy_fits_uint16(L);
+
+    std::atomic<size_t> next_shard(0);
+    auto worker = [&]() {
+        size_t shard;
+        while ((shard = next_shard.fetch_add(1)) < n_shards) {
+            std::string name = get_shard_name(output_prefix, n_tokens_suffix, shard, n_shards);
+            if (is_uint16) {
+                shard_tokens[shard] = write_npy_records<uint16_t>(seq, bounds, shard_bounds[shard], shard_bounds[shard + 1], name + ".tokens.npy", name + ".offsets.npy", shard_errors[shard]);
+            } else {
+                shard_tokens[shard] = write_npy_records<uint32_t>(seq, bounds, shard_bounds[shard], shard_bounds[shard + 1], name + ".tokens.npy", name + ".offsets.npy", shard_errors[shard]);
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < std::max((size_t)1, std::min(n_threads, n_shards)); i++) {
+        threads.emplace_back(worker);
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    // the workers only record errors, they are reported from here
+    for (const std::string& error : shard_errors) {
+        if (!error.empty()) {
+            std::cerr << "Error: " << error << std::endl;
+            exit(1);
+        }
+    }
+
+    ordered_json manifest;
+    manifest["vocab_size"] = L;
+    manifest["dtype"] = is_uint16 ? npy_dtype<uint16_t>() : npy_dtype<uint32_t>();
+    manifest["n_records"] = bounds.size() - 1;
+    manifest["shards"] = ordered_json::array();
+    for (size_t shard = 0; shard < n_shards; shard++) {
+        std::string name = get_shard_name(output_prefix, n_tokens_suffix, shard, n_shards);
+        std::string base_name = std::filesystem::path(name).filename().string();
+        manifest["shards"].push_back({
+            {"tokens", base_name + ".tokens.npy"},
+            {"offsets", base_name + ".offsets.npy"},
+            {"first_record", shard_bounds[shard]},
+            {"n_records", shard_bounds[shard + 1] - shard_bounds[shard]},
+            {"n_tokens", shard_tokens[shard]}
+        });
+    }
+    std::string manifest_file = output_prefix + "." + n_tokens_suffix + ".shards.json";
+    std::ofstream manifest_out(manifest_file);
+    manifest_out << std::setw(2) << manifest << std::endl;
+    manifest_out.close();
+    std::cout << "Saved " << n_shards << " shards, manifest " << manifest_file << std::endl;
+}
+
 #endif
\ No newline at end of file
@@ -13,99 +13,267 @@
 #include <cstring>
 #include <atomic>
 #include <cmath>
+#include <algorithm>
+#include <memory>
 
 #include "tokens.hpp"
+#include "mapped.hpp"
 
 // typedef CounterType to uint32_t
 typedef uint32_t CounterType;
 
-class PositionsContainer {
+// Size-class allocator of position buffers. A buffer of 2^k positions is
+// carved out of a chunk and, when its list grows or is removed, goes to
+// the free list of its class for the next list of that size. The millions of
+// short lists of new kmers so cost no heap allocation each and do not
+// fragment the heap. Buffers over the largest class are arrays of their own.
+// Chunks are 1 MB on the heap; out of core they are 64 MB mappings, whose
+// pages are only backed once touched, so that a large genome does not need a
+// file mapping per megabyte (vm.max_map_count, and trim_to_budget madvises
+// every mapping). Chunks are freed all together with the allocator. Not thread-safe: lists
+// are created and grown from one thread (the threaded init allocates exact
+// capacities first).
+class PositionsSlab {
 public:
 
-    PositionsContainer() {
-        max_size_ = 100;
-        positions = nullptr;
-        size_ = 0;   
+    static const size_t MIN_CLASS = 2; // 4 positions
+    static const size_t MAX_CLASS = 15; // 32768 positions, 256 KB
+    static const size_t CHUNK_SIZE = 1 << 17; // positions, 1 MB
+    static const size_t MAPPED_CHUNK_SIZE = 1 << 23; // positions, 64 MB
+
+    PositionsSlab() : chunk_size_(is_out_of_core() ? MAPPED_CHUNK_SIZE : CHUNK_SIZE), free_lists_(MAX_CLASS + 1), chunk_ends_(MAX_CLASS + 1, 0), chunk_tops_(MAX_CLASS + 1, nullptr) {
     }
 
-    PositionsContainer(size_t size) {
-        
-        positions = new size_t[size];
-        for (size_t i = 0; i < size; i++) {
-            positions[i] = 0;
+    PositionsSlab(const PositionsSlab&) = delete;
+    PositionsSlab& operator=(const PositionsSlab&) = delete;
+
+    ~PositionsSlab() {
+        for (size_t* chunk : chunks_) {
+            free_array(chunk);
         }
-        size_ = 0;
-        max_size_ = size;
     }
 
-    // the copy constructor
-    PositionsContainer(const PositionsContainer& other)
-    : max_size_(other.max_size_) {
-        size_.store(other.size_.load());
-        positions = new size_t[max_size_];
-        for (size_t i = 0; i < max_size_; i++) {
-            positions[i] = other.positions[i];
+    // capacity of the buffer allocate gives for at least n positions
+    static size_t get_capacity(size_t n) {
+        if (n > ((size_t)1 << MAX_CLASS)) {
+            return n;
+        }
+        size_t capacity = (size_t)1 << MIN_CLASS;
+        while (capacity < n) {
+            capacity *= 2;
+        }
+        return capacity;
+    }
+
+    // capacity must come from get_capacity
+    size_t* allocate(size_t capacity) {
+        if (capacity > ((size_t)1 << MAX_CLASS)) {
+            return allocate_array<size_t>(capacity);
+        }
+        size_t size_class = get_class(capacity);
+        std::vector<size_t*>& free_list = free_lists_[size_class];
+        if (!free_list.empty()) {
+            size_t* buffer = free_list.back();
+            free_list.pop_back();
+            return buffer;
+        }
+        if (chunk_tops_[size_class] == nullptr || chunk_ends_[size_class] + capacity > chunk_size_) {
+            chunks_.push_back(allocate_array<size_t>(chunk_size_));
+            chunk_tops_[size_class] = chunks_.back();
+            chunk_ends_[size_class] = 0;
+        }
+        size_t* buffer = chunk_tops_[size_class] + chunk_ends_[size_class];
+        chunk_ends_[size_class] += capacity;
+        return buffer;
+    }
+
+    void deallocate(size_t* buffer, size_t capacity) {
+        if (capacity > ((size_t)1 << MAX_CLASS)) {
+            free_array(buffer);
+            return;
         }
+        free_lists_[get_class(capacity)].push_back(buffer);
+    }
+
+private:
+
+    static size_t get_class(size_t capacity) {
+        size_t size_class = MIN_CLASS;
+        while (((size_t)1 << size_class) < capacity) {
+            size_class++;
+        }
+        return size_class;
+    }
+
+    size_t chunk_size_; // positions
+    std::vector<size_t*> chunks_;
+    std::vector<std::vector<size_t*>> free_lists_; // by class
+    std::vector<size_t> chunk_ends_; // used positions of the current chunk of each class
+    std::vector<size_t*> chunk_tops_; // current chunk of each class
+};
+
+// Compressed positions of a long list. Positions come in blocks of
+// BLOCK_SIZE: the first of a block is stored as it is, the others as the
+// difference to the one before, all as varints of 7 bits a byte (zigzag, so
+// that a list out of order still packs). Positions of a kmer are mostly
+// increasing and close, so most take one or two bytes instead of eight.
+// block_starts gives random access; a walk decodes the bytes in one run. Both
+// are MappedVectors, file-backed in out-of-core mode once they are large.
+struct PackedPositions {
+
+    static const size_t BLOCK_SIZE = 128;
+
+    MappedVector<uint8_t> bytes;
+    MappedVector<uint64_t> block_starts; // offset in bytes of each block
+    size_t last = 0; // the last position added
+
+    // value is the position of number index in the list
+    void append(size_t value, size_t index) {
+        if (index % BLOCK_SIZE == 0) {
+            block_starts.push_back(bytes.size());
+            write_varint(value);
+        } else {
+            int64_t delta = (int64_t)(value - last);
+            write_varint(((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+        }
+        last = value;
+    }
+
+    // decodes the block of index up to it, so up to BLOCK_SIZE varints a
+    // call; walks go through PositionsReader instead
+    size_t get(size_t index) const {
+        const uint8_t* p = bytes.data() + block_starts[index / BLOCK_SIZE];
+        size_t value = read_varint(p);
+        for (size_t i = 0; i < index % BLOCK_SIZE; i++) {
+            value = add_delta(value, read_varint(p));
+        }
+        return value;
+    }
+
+    // the first n positions in order
+    void decode(size_t* out, size_t n) const {
+        const uint8_t* p = bytes.data();
+        size_t value = 0;
+        for (size_t i = 0; i < n; i++) {
+            uint64_t varint = read_varint(p);
+            value = i % BLOCK_SIZE == 0 ? varint : add_delta(value, varint);
+            out[i] = value;
+        }
+    }
+
+    static uint64_t read_varint(const uint8_t*& p) {
+        uint64_t value = *p++;
+        if (value < 0x80) {
+            return value;
+        }
+        value &= 0x7f;
+        for (size_t shift = 7;; shift += 7) {
+            uint64_t byte = *p++;
+            value |= (byte & 0x7f) << shift;
+            if (byte < 0x80) {
+                return value;
+            }
+        }
+    }
+
+    static size_t add_delta(size_t value, uint64_t zigzag) {
+        return value + (size_t)((zigzag >> 1) ^ (~(zigzag & 1) + 1));
+    }
+
+private:
+
+    void write_varint(uint64_t value) {
+        while (value >= 0x80) {
+            bytes.push_back((uint8_t)(value | 0x80));
+            value >>= 7;
+        }
+        bytes.push_back((uint8_t)value);
+    }
+};
+
+// Positions of a kmer, each stored plus one. Up to INLINE_CAPACITY positions
+// are kept in the object itself; longer lists take their buffer from a
+// PositionsSlab, or get an array of their own without one. A list of
+// PACK_MIN_SIZE positions or more is packed (PackedPositions) when its buffer
+// fills up or by pack(); it is read in order with a PositionsReader. Adding
+// from many threads at once is only safe into a buffer that has room for all
+// of them, as the threaded init makes.
+class PositionsContainer {
+public:
+
+    static const size_t INLINE_CAPACITY = 2;
+    static const size_t PACK_MIN_SIZE = PackedPositions::BLOCK_SIZE;
+
+    PositionsContainer() {
+        positions = inline_positions_;
+        max_size_ = INLINE_CAPACITY;
+    }
+
+    PositionsContainer(size_t size, PositionsSlab* slab = nullptr) : slab_(slab) {
+        allocate(size);
+    }
+
+    // the copy owns its buffer, outside of any slab
+    PositionsContainer(const PositionsContainer& other) {
+        copy_from(other);
     }
     
     // the copy assignment operator
     PositionsContainer& operator=(const PositionsContainer& other) {
         if (this != &other) {
-            // Free the existing memory if necessary
-            if (positions != nullptr) {
-                delete[] positions;
-            }
-
-            // Copy the size and max_size values
-            size_.store(other.size_.load());
-            max_size_ = other.max_size_;
-
-            // Allocate new memory for positions and copy the elements from the other object
-            positions = new size_t[max_size_];
-            for (size_t i = 0; i < max_size_; i++) {
-                positions[i] = other.positions[i];
-            }
+            release();
+            slab_ = nullptr;
+            copy_from(other);
         }
         return *this;
     }
 
     // Move constructor
-    PositionsContainer(PositionsContainer&& other) noexcept
-        : positions(other.positions), max_size_(other.max_size_) {
-        size_.store(other.size_.load());
-        // Nullify the pointers in the other object to avoid double deletion
-        other.positions = nullptr;
-        other.size_ = 0;
-        other.max_size_ = 0;
+    PositionsContainer(PositionsContainer&& other) noexcept {
+        take_from(other);
     }
 
     // Move assignment operator
     PositionsContainer& operator=(PositionsContainer&& other) noexcept {
         if (this != &other) {
-            if (positions != nullptr) delete[] positions;
-
-            positions = other.positions;
-            size_.store(other.size_.load());
-            max_size_ = other.max_size_;
-
-            other.positions = nullptr;
-            other.size_ = 0;
-            other.max_size_ = 0;
+            release();
+            take_from(other);
         }
         return *this;
     }
 
 
     ~PositionsContainer() {
-        if (positions != nullptr) {
-            delete[] positions;
-        }
+        release();
     }
 
     void set(size_t index) {
+        if (packed_) {
+            if (index + 1 < packed_->last) {
+                sorted_.store(false, std::memory_order_relaxed);
+            }
+            packed_->append(index + 1, size_.fetch_add(1));
+            return;
+        }
         if (size_.load() >= max_size_) {
+            if (size_.load() >= PACK_MIN_SIZE) {
+                pack();
+                set(index);
+                return;
+            }
             extend_counts();
         }
+        size_t slot = size_.fetch_add(1);
+        positions[slot] = index + 1;
+        if (slot > 0 && positions[slot - 1] > index + 1) {
+            sorted_.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    // set() for many threads filling one list at once: the list must already
+    // have room for all positions, and as the order check of set() would read
+    // a slot another thread may be writing, the caller sorts the list afterwards
+    void set_unordered(size_t index) {
         positions[size_.fetch_add(1)] = index + 1;
     }
 
@@ -114,38 +282,84 @@ public:
             std::cout << "index >= size_" << std::endl;
             exit(1);
         }
-        return positions[index] - 1;
+        return get_plus_one_position(index) - 1;
     }
 
+    // random access, which for a packed list decodes up to a block per call
+    // (PackedPositions::get); for debugging, walks use a PositionsReader
     size_t get_plus_one_position(size_t index) {
         if (index >= size_) {
             std::cout << "index >= size_" << std::endl;
             exit(1);
         }
+        if (packed_) {
+            return packed_->get(index);
+        }
         return positions[index];
     }
 
+    // drops the positions and gives the buffer back
     void clear() {
-        if (positions != nullptr) {
-            delete[] positions;
-            positions = nullptr;
+        release();
+        packed_.reset();
+        positions = inline_positions_;
+        size_ = 0;
+        max_size_ = INLINE_CAPACITY;
+        sorted_ = true;
+    }
+
+    // orders the positions so that a walk over them sweeps the container
+    // arrays from left to right; removed entries (zeros) come first
+    void sort() {
+        if (packed_) {
+            std::vector<size_t> values(size_.load());
+            packed_->decode(values.data(), values.size());
+            std::sort(values.begin(), values.end());
+            pack_values(values.data());
+        } else {
+            std::sort(positions, positions + size_.load());
+        }
+        sorted_ = true;
+    }
+
+    // packs a list of PACK_MIN_SIZE positions or more and gives its buffer back
+    void pack() {
+        if (packed_ || size_.load() < PACK_MIN_SIZE) {
+            return;
         }
+        size_t* buffer = positions;
+        pack_values(buffer);
+        release(buffer, max_size_);
+        positions = inline_positions_;
+        max_size_ = INLINE_CAPACITY;
+    }
+
+    bool is_packed() const {
+        return packed_ != nullptr;
+    }
+
+    // bytes taken by the positions, not counting the object itself
+    size_t get_bytes() const {
+        if (packed_) {
+            return packed_->bytes.capacity() + packed_->block_starts.capacity() * sizeof(uint64_t);
+        }
+        return positions == inline_positions_ ? 0 : max_size_ * sizeof(size_t);
+    }
+
+    // false once a position was added below the one before it
+    bool is_sorted() const {
+        return sorted_.load(std::memory_order_relaxed);
     }
     u_int64_t size() const {
         return size_.load();
     }
 
     void extend_counts() {
-        size_t* new_positions = new size_t[max_size_ * 2];
-        for (size_t i = 0; i < max_size_; i++) {
-            new_positions[i] = positions[i];
-        }
-        for (size_t i = max_size_; i < max_size_ * 2; i++) {
-            new_positions[i] = 0;
-        }
-        delete[] positions;
-        positions = new_positions;
-        max_size_ *= 2;
+        size_t old_size = max_size_;
+        size_t* old_positions = positions;
+        allocate(std::max(max_size_ * 2, (size_t)16));
+        memcpy(positions, old_positions, std::min((size_t)size_.load(), old_size) * sizeof(size_t));
+        release(old_positions, old_size);
     }
 
     void diagnostic_print_of_state() {
@@ -153,22 +367,128 @@ public:
         std::cout << "POSITIONS" << std::endl;
         std::cout << "size_: " << size_ << std::endl;
         std::cout << "max_size_: " << max_size_ << std::endl;
+        std::cout << "packed: " << is_packed() << std::endl;
         std::cout << "positions: " << std::endl;
-        if (positions == nullptr) {
-            std::cout << "nullptr" << std::endl;
-            return;
-        }
         for (size_t i = 0; i < size_; i++) {
-            std::cout << positions[i] << " ";
+            std::cout << get_plus_one_position(i) << " ";
         }
         std::cout << std::endl;
     }
 
 
 private:
+
+    friend class PositionsReader;
+
+    // replaces the packed positions with the first size_ of values
+    void pack_values(const size_t* values) {
+        size_t n = size_.load();
+        std::unique_ptr<PackedPositions> packed = std::make_unique<PackedPositions>();
+        packed->bytes.reserve(n + n / 2);
+        for (size_t i = 0; i < n; i++) {
+            packed->append(values[i], i);
+        }
+        packed->bytes.shrink_to_fit();
+        packed_ = std::move(packed);
+    }
+
+    // a buffer of at least size positions, inline if they fit
+    void allocate(size_t size) {
+        if (size <= INLINE_CAPACITY) {
+            positions = inline_positions_;
+            max_size_ = INLINE_CAPACITY;
+        } else if (slab_ != nullptr) {
+            max_size_ = PositionsSlab::get_capacity(size);
+            positions = slab_->allocate(max_size_);
+        } else {
+            max_size_ = size;
+            positions = allocate_array<size_t>(size);
+        }
+    }
+
+    void release(size_t* buffer, size_t capacity) {
+        if (buffer == inline_positions_ || buffer == nullptr) {
+            return;
+        }
+        if (slab_ != nullptr) {
+            slab_->deallocate(buffer, capacity);
+        } else {
+            free_array(buffer);
+        }
+    }
+
+    void release() {
+        release(positions, max_size_);
+        positions = nullptr;
+    }
+
+    void copy_from(const PositionsContainer& other) {
+        packed_.reset();
+        size_.store(other.size_.load());
+        sorted_.store(other.sorted_.load());
+        if (other.packed_) {
+            allocate(0);
+            packed_ = std::make_unique<PackedPositions>(*other.packed_);
+            return;
+        }
+        allocate(other.max_size_);
+        memcpy(positions, other.positions, size_.load() * sizeof(size_t));
+    }
+
+    void take_from(PositionsContainer& other) {
+        size_.store(other.size_.load());
+        sorted_.store(other.sorted_.load());
+        max_size_ = other.max_size_;
+        slab_ = other.slab_;
+        packed_ = std::move(other.packed_);
+        if (other.positions == other.inline_positions_) {
+            memcpy(inline_positions_, other.inline_positions_, sizeof(inline_positions_));
+            positions = inline_positions_;
+        } else {
+            positions = other.positions;
+        }
+        other.positions = other.inline_positions_;
+        other.size_ = 0;
+        other.max_size_ = INLINE_CAPACITY;
+    }
+
     size_t* positions = nullptr;
     std::atomic<u_int64_t> size_ = 0;
-    size_t max_size_ = 1000;
+    size_t max_size_ = 0;
+    std::atomic<bool> sorted_ = true;
+    PositionsSlab* slab_ = nullptr;
+    std::unique_ptr<PackedPositions> packed_; // the positions once packed, positions is unused then
+    size_t inline_positions_[INLINE_CAPACITY] = {};
+};
+
+// Reads the positions of a list, plus one, in the order they were added. The
+// list must not change while it is read.
+class PositionsReader {
+public:
+
+    PositionsReader(const PositionsContainer& positions) {
+        if (positions.packed_) {
+            bytes_ = positions.packed_->bytes.data();
+        } else {
+            raw_ = positions.positions;
+        }
+    }
+
+    size_t next() {
+        if (raw_ != nullptr) {
+            return raw_[index_++];
+        }
+        uint64_t value = PackedPositions::read_varint(bytes_);
+        last_ = index_ % PackedPositions::BLOCK_SIZE == 0 ? value : PackedPositions::add_delta(last_, value);
+        index_++;
+        return last_;
+    }
+
+private:
+    const size_t* raw_ = nullptr;
+    const uint8_t* bytes_ = nullptr;
+    size_t index_ = 0;
+    size_t last_ = 0;
 };
 
 #endif
\ No newline at end of file
@@ -4,13 +4,20 @@
 #include <string>
 #include <vector>
 #include <sstream>
+#include <deque>
+#include <string_view>
 #include <unordered_map>
 #include <iostream>
+#include <algorithm>
+#include <cctype>
 
 #include "tokens.hpp"
 
 
-std::vector<TokenType> get_dataset(const std::vector<std::string>& seqs, const std::unordered_map<std::string, TokenType>& alphabet) {
+// With masked_bases, soft-masked (lowercase) bases become [MASK] tokens, which
+// like N are never merged, and the bases themselves are appended to
+// masked_bases in order, so they can be put back with unmask_bases.
+std::vector<TokenType> get_dataset(const std::vector<std::string>& seqs, const std::unordered_map<std::string, TokenType>& alphabet, std::string* masked_bases = nullptr) {
 
     size_t N = 0;
     for (auto& s : seqs) {
@@ -20,12 +27,19 @@ std::vector<TokenType> get_dataset(const std::vector<std::string>& seqs, const s
     std::vector<TokenType> seq;
     seq.reserve(N); // Reserve space
     std::string temp(1, '\0');
+    TokenType mask_token = masked_bases != nullptr ? alphabet.at("[MASK]") : 0;
     size_t i = 0;
     for (auto& s : seqs) {
         for (auto x : s) {
             if (x == '\n') {
                 x = '~';
             }
+            if (masked_bases != nullptr && std::islower((unsigned char)x)) {
+                seq.emplace_back(mask_token);
+                masked_bases->push_back(std::toupper((unsigned char)x));
+                ++i;
+                continue;
+            }
             temp[0] = x;
             auto it = alphabet.find(temp);
             if (it != alphabet.end()) {
@@ -46,4 +60,159 @@ std::vector<TokenType> get_dataset(const std::vector<std::string>& seqs, const s
 
 }
 
+// puts the soft-masked bases back in place of the [MASK] tokens of an encoding
+void unmask_bases(std::vector<TokenType>& seq, const std::string& masked_bases, const std::unordered_map<std::string, TokenType>& alphabet) {
+    if (masked_bases.empty()) {
+        return;
+    }
+    TokenType mask_token = alphabet.at("[MASK]");
+    std::string temp(1, '\0');
+    size_t k = 0;
+    for (auto& token : seq) {
+        if (token == mask_token) {
+            temp[0] = masked_bases[k++];
+            auto it = alphabet.find(temp);
+            token = it != alphabet.end() ? it->second : alphabet.at("[UNK]");
+        }
+    }
+}
+
+// Records deduplicated while they are read: only the first copy of each
+// sequence is kept, with the number of times it occurs, and order maps every
+// input record to its unique sequence. Training on the unique records with
+// pairs counted that many times gives the same merges as on all of them,
+// since a record is merged the same way wherever it occurs.
+struct UniqueRecords {
+    std::deque<std::string> seqs; // a deque keeps the keys of index in place
+    std::vector<uint32_t> counts;
+    std::vector<size_t> order;
+    std::unordered_map<std::string_view, size_t> index;
+
+    void push_back(const std::string& seq) {
+        auto it = index.find(seq);
+        if (it == index.end()) {
+            seqs.push_back(seq);
+            counts.push_back(0);
+            it = index.emplace(seqs.back(), seqs.size() - 1).first;
+        }
+        counts[it->second]++;
+        order.push_back(it->second);
+    }
+
+    // hands the unique sequences over in order of first occurrence
+    std::vector<std::string> take_sequences() {
+        std::cout << "Deduplicated " << order.size() << " records to " << seqs.size() << " unique" << std::endl;
+        index.clear();
+        std::vector<std::string> unique_seqs;
+        unique_seqs.reserve(seqs.size());
+        for (auto& seq : seqs) {
+            unique_seqs.push_back(std::move(seq));
+        }
+        seqs.clear();
+        return unique_seqs;
+    }
+};
+
+// weight of every token of the unique records, the count of its record; each
+// record ends with its ~, helper runs may be compacted already
+std::vector<uint32_t> get_token_weights(const std::vector<TokenType>& seq, const UniqueRecords& records) {
+    std::vector<uint32_t> weights(seq.size());
+    size_t record = 0;
+    for (size_t i = 0; i < seq.size(); i++) {
+        weights[i] = records.counts[std::min(record, records.counts.size() - 1)];
+        if (seq[i] == 5) {
+            record++;
+        }
+    }
+    return weights;
+}
+
+// the encoding of all input records from the encoding of the unique ones
+std::vector<TokenType> expand_records(const std::vector<TokenType>& seq, const UniqueRecords& records) {
+    std::vector<size_t> starts(1, 0);
+    for (size_t i = 0; i < seq.size(); i++) {
+        if (seq[i] == 5) {
+            starts.push_back(i + 1);
+        }
+    }
+    size_t n = 0;
+    for (size_t record : records.order) {
+        n += starts[record + 1] - starts[record];
+    }
+    std::vector<TokenType> expanded;
+    expanded.reserve(n);
+    for (size_t record : records.order) {
+        expanded.insert(expanded.end(), seq.begin() + starts[record], seq.begin() + starts[record + 1]);
+    }
+    return expanded;
+}
+
+// Runs of one repeated helper token other than ~ (N, [UNK], ...) are trained
+// as a single token: pairs with a helper token are never merged, so the merges
+// stay the same, and since helper tokens are never merged either the i-th of
+// them in the input is the i-th in the encoding. runs holds (i, run length)
+// for the runs longer than one, so that the encoding can be expanded back.
+struct HelperRuns {
+    std::vector<std::pair<size_t, size_t>> runs;
+    size_t n_removed = 0;
+};
+
+bool is_run_helper_token(TokenType token) {
+    return token <= N_HELP_TOKENS && token != 5;
+}
+
+HelperRuns compact_helper_runs(std::vector<TokenType>& seq) {
+    HelperRuns helper_runs;
+    size_t n_helpers = 0;
+    size_t w = 0;
+    for (size_t i = 0; i < seq.size(); ) {
+        size_t j = i + 1;
+        if (is_run_helper_token(seq[i])) {
+            while (j < seq.size() && seq[j] == seq[i]) {
+                j++;
+            }
+            if (j - i > 1) {
+                helper_runs.runs.emplace_back(n_helpers, j - i);
+                helper_runs.n_removed += j - i - 1;
+            }
+            n_helpers++;
+        }
+        seq[w++] = seq[i];
+        i = j;
+    }
+    seq.resize(w);
+    if (helper_runs.n_removed) {
+        std::cout << "Compacted " << helper_runs.runs.size() << " runs of N and other helper tokens, " << helper_runs.n_removed << " tokens less" << std::endl;
+    }
+    return helper_runs;
+}
+
+// undoes compact_helper_runs on an encoding, in place from the back
+void expand_helper_runs(std::vector<TokenType>& seq, const HelperRuns& helper_runs) {
+    if (helper_runs.n_removed == 0) {
+        return;
+    }
+    size_t n_helpers = 0;
+    for (TokenType token : seq) {
+        n_helpers += is_run_helper_token(token);
+    }
+    size_t n = seq.size();
+    seq.resize(n + helper_runs.n_removed);
+    size_t w = seq.size();
+    size_t k = helper_runs.runs.size();
+    for (size_t i = n; i-- > 0; ) {
+        size_t length = 1;
+        if (is_run_helper_token(seq[i])) {
+            n_helpers--;
+            if (k > 0 && helper_runs.runs[k - 1].first == n_helpers) {
+                length = helper_runs.runs[--k].second;
+            }
+        }
+        TokenType token = seq[i];
+        for (size_t r = 0; r < length; r++) {
+            seq[--w] = token;
+        }
+    }
+}
+
 #endif
@@ -7,6 +7,15 @@
 #include <iostream>
 #include <algorithm>
 
+// Readers append each record with seqs.push_back, seqs is a vector of strings
+// or a UniqueRecords (preprocess.hpp) that keeps only the first copy of each.
+// Sequences are uppercased unless keep_case is set, so that soft-masked
+// (lowercase) bases can be told apart.
+
+void to_upper(std::string& seq) {
+  std::transform(seq.begin(), seq.end(), seq.begin(),
+              [](unsigned char c){ return std::toupper(c); });
+}
 
 // reader for BPE tokenized files
 void get_sequences_bpe(const std::string& bpe_file_name, const std::string& pos_file_name, std::vector<std::string>& seqs) {
@@ -39,7 +48,8 @@ void get_sequences_bpe(const std::string& bpe_file_name, const std::string& pos_
   }
 }
 
-void get_sequences_fasta(const std::string& file_name, std::vector<std::string>& seqs) {
+template<typename Records>
+void get_sequences_fasta(const std::string& file_name, Records& seqs, bool keep_case = false) {
   std::ifstream file(file_name);
   if (!file.is_open()) {
     std::cerr << "Error: Could not open file " << file_name << std::endl;
@@ -55,20 +65,22 @@ void get_sequences_fasta(const std::string& file_name, std::vector<std::string>&
         seq.clear();
       }
     } else {
+      if (!keep_case) {
+        to_upper(line);
+      }
       seq += line;
     }
   }
 
   if (!seq.empty()) {
-    std::transform(seq.begin(), seq.end(), seq.begin(),
-               [](unsigned char c){ return std::toupper(c); });
     seqs.push_back(seq);
   }
 
   file.close();
 }
 
-void get_sequences_fastq(const std::string& file_name, std::vector<std::string>& seqs) {
+template<typename Records>
+void get_sequences_fastq(const std::string& file_name, Records& seqs) {
   std::ifstream file(file_name);
   if (!file.is_open()) {
     std::cerr << "Error: Could not open file " << file_name << std::endl;
@@ -89,7 +101,8 @@ void get_sequences_fastq(const std::string& file_name, std::vector<std::string>&
   file.close();
 }
 
-void get_sequences_trf(const std::string& trf_file_name, std::vector<std::string>& seqs) {
+template<typename Records>
+void get_sequences_trf(const std::string& trf_file_name, Records& seqs) {
     std::ifstream fh(trf_file_name);
     if (fh.is_open()) {
         std::string line;
@@ -106,13 +119,15 @@ void get_sequences_trf(const std::string& trf_file_name, std::vector<std::string
     }
 }
 
-void get_sequences_reads(const std::string& reads_file_name, std::vector<std::string>& seqs) {
+template<typename Records>
+void get_sequences_reads(const std::string& reads_file_name, Records& seqs, bool keep_case = false) {
     std::ifstream fh(reads_file_name);
     if (fh.is_open()) {
         std::string line;
         while (std::getline(fh, line)) {
-            std::transform(line.begin(), line.end(), line.begin(),
-               [](unsigned char c){ return std::toupper(c); });
+            if (!keep_case) {
+                to_upper(line);
+            }
             seqs.push_back(line);
         }
         fh.close();
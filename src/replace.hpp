@@ -0,0 +1,186 @@
+#ifndef REPLACE_FILE_H
+#define REPLACE_FILE_H
+
+#include <vector>
+#include <thread>
+#include <cstring>
+#include <algorithm>
+
+#include "tokens.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define REPLACE_X86
+#endif
+
+// Pair replacement for engines that keep the sequence as a flat token array.
+// Occurrences are found with vector compares of seq[i] and seq[i + 1] against
+// the pair, in chunks on several threads, and the array is compacted in place
+// batch by batch, so no buffer grows with the sequence.
+
+// below this many pairs per thread a scan is not worth a thread
+const size_t REPLACE_MIN_CHUNK = 1 << 20;
+
+// appends the positions i in [start, end) where the pair (a, b) starts, seq[end] must be readable
+void find_pair_scalar(const TokenType* seq, size_t start, size_t end, TokenType a, TokenType b, std::vector<size_t>& positions) {
+    for (size_t i = start; i < end; i++) {
+        if (seq[i] == a && seq[i + 1] == b) {
+            positions.push_back(i);
+        }
+    }
+}
+
+#ifdef REPLACE_X86
+
+__attribute__((target("avx2")))
+void find_pair_avx2(const TokenType* seq, size_t start, size_t end, TokenType a, TokenType b, std::vector<size_t>& positions) {
+    const __m256i va = _mm256_set1_epi32((int)a);
+    const __m256i vb = _mm256_set1_epi32((int)b);
+    size_t i = start;
+    for (; i + 8 <= end; i += 8) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(seq + i));
+        __m256i y = _mm256_loadu_si256((const __m256i*)(seq + i + 1));
+        __m256i match = _mm256_and_si256(_mm256_cmpeq_epi32(x, va), _mm256_cmpeq_epi32(y, vb));
+        unsigned mask = _mm256_movemask_ps(_mm256_castsi256_ps(match));
+        while (mask) {
+            positions.push_back(i + __builtin_ctz(mask));
+            mask &= mask - 1;
+        }
+    }
+    find_pair_scalar(seq, i, end, a, b, positions);
+}
+
+__attribute__((target("sse2")))
+void find_pair_sse2(const TokenType* seq, size_t start, size_t end, TokenType a, TokenType b, std::vector<size_t>& positions) {
+    const __m128i va = _mm_set1_epi32((int)a);
+    const __m128i vb = _mm_set1_epi32((int)b);
+    size_t i = start;
+    for (; i + 4 <= end; i += 4) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(seq + i));
+        __m128i y = _mm_loadu_si128((const __m128i*)(seq + i + 1));
+        __m128i match = _mm_and_si128(_mm_cmpeq_epi32(x, va), _mm_cmpeq_epi32(y, vb));
+        unsigned mask = _mm_movemask_ps(_mm_castsi128_ps(match));
+        while (mask) {
+            positions.push_back(i + __builtin_ctz(mask));
+            mask &= mask - 1;
+        }
+    }
+    find_pair_scalar(seq, i, end, a, b, positions);
+}
+
+#endif
+
+// picks the widest kernel the CPU supports
+void find_pair_range(const TokenType* seq, size_t start, size_t end, TokenType a, TokenType b, std::vector<size_t>& positions) {
+#ifdef REPLACE_X86
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    if (has_avx2) {
+        find_pair_avx2(seq, start, end, a, b, positions);
+    } else {
+        find_pair_sse2(seq, start, end, a, b, positions);
+    }
+#else
+    find_pair_scalar(seq, start, end, a, b, positions);
+#endif
+}
+
+// pairs scanned by one thread in a batch; bounds its buffer of positions to
+// 8 bytes a pair even when every position matches (a homopolymer)
+const size_t REPLACE_BATCH = 1 << 21;
+
+// Neighbours of an occurrence at the time it is replaced. left is the token
+// now in front of it, L if the occurrence right before was replaced; right is
+// the token after the pair, and right_replaced tells that it starts the next
+// occurrence. has_left and has_right are false at the ends of the sequence.
+struct PairNeighbours {
+    bool has_left = false;
+    TokenType left = 0;
+    bool left_replaced = false;
+    bool has_right = false;
+    TokenType right = 0;
+    bool right_replaced = false;
+};
+
+// Replaces the pair (a, b) by L left to right, in place, and returns the
+// number of replacements; on_replace(const PairNeighbours&) is called for each
+// before L is written. Occurrences of different tokens never overlap, in a
+// run a a a a of a self-pair every other position is taken, starting from the
+// head of the run. The sequence is scanned in batches of REPLACE_BATCH pairs
+// per thread; each batch is then compacted in order with one memmove per gap.
+// Tokens from r on are never written before they are read, so the scan of
+// the next batch and the right neighbours see the input, and a run that
+// crosses a batch border is resolved there by skipping the positions below r.
+template<typename Callback>
+size_t replace_pair(std::vector<TokenType>& seq, TokenType a, TokenType b, TokenType L, size_t n_threads, Callback on_replace) {
+    size_t n = seq.size();
+    if (n < 2) {
+        return 0;
+    }
+    size_t n_pairs = n - 1;
+    n_threads = std::max((size_t)1, std::min(n_threads, n_pairs / REPLACE_MIN_CHUNK));
+    TokenType* data = seq.data();
+    std::vector<std::vector<size_t>> chunk_positions(n_threads);
+    size_t w = 0; // next token to write
+    size_t r = 0; // first token not moved yet
+    size_t n_replaced = 0;
+
+    for (size_t batch_start = 0; batch_start < n_pairs; batch_start += n_threads * REPLACE_BATCH) {
+        size_t batch_end = std::min(n_pairs, batch_start + n_threads * REPLACE_BATCH);
+        size_t n_chunks = (batch_end - batch_start + REPLACE_BATCH - 1) / REPLACE_BATCH;
+        auto find_chunk = [&, data, a, b](size_t c) {
+            size_t start = batch_start + c * REPLACE_BATCH;
+            chunk_positions[c].clear();
+            find_pair_range(data, start, std::min(batch_end, start + REPLACE_BATCH), a, b, chunk_positions[c]);
+        };
+        if (n_chunks == 1) {
+            find_chunk(0);
+        } else {
+            std::vector<std::thread> threads;
+            for (size_t c = 0; c < n_chunks; c++) {
+                threads.emplace_back(find_chunk, c);
+            }
+            for (auto& t : threads) {
+                t.join();
+            }
+        }
+
+        for (size_t c = 0; c < n_chunks; c++) {
+            for (size_t p : chunk_positions[c]) {
+                if (p < r) {
+                    continue; // the second token of the occurrence just replaced
+                }
+                PairNeighbours neighbours;
+                neighbours.left_replaced = n_replaced > 0 && p == r;
+                if (p > r) {
+                    std::memmove(data + w, data + r, (p - r) * sizeof(TokenType));
+                    w += p - r;
+                }
+                neighbours.has_left = w > 0;
+                neighbours.left = w > 0 ? data[w - 1] : 0;
+                neighbours.has_right = p + 2 < n;
+                neighbours.right = p + 2 < n ? data[p + 2] : 0;
+                neighbours.right_replaced = p + 3 < n && data[p + 2] == a && data[p + 3] == b;
+                on_replace(neighbours);
+                data[w++] = L;
+                r = p + 2;
+                n_replaced++;
+            }
+        }
+    }
+    if (n_replaced == 0) {
+        return 0;
+    }
+    if (r < n) {
+        std::memmove(data + w, data + r, (n - r) * sizeof(TokenType));
+        w += n - r;
+    }
+    seq.resize(w);
+    return n_replaced;
+}
+
+// replaces the pair (a, b) by L left to right, returns the number of replacements
+size_t replace_pair(std::vector<TokenType>& seq, TokenType a, TokenType b, TokenType L, size_t n_threads) {
+    return replace_pair(seq, a, b, L, n_threads, [](const PairNeighbours&) {});
+}
+
+#endif
@@ -0,0 +1,632 @@
+#ifndef SHARDS_FILE_H
+#define SHARDS_FILE_H
+
+#include <string>
+#include <vector>
+#include <queue>
+#include <memory>
+#include <iostream>
+#include <algorithm>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <fstream>
+#include <stdexcept>
+#include <type_traits>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "tokens.hpp"
+#include "container.hpp"
+#include "trainer.hpp"
+#include "lowmem.hpp"
+#include "output.hpp"
+#include "mapped.hpp"
+
+// Multi-process training: the input is cut into shards at helper tokens
+// (record separators, N), so that no mergeable pair spans two shards, and
+// each shard is trained by a forked worker process with its own engine. The
+// coordinator keeps only the global pair counts: it picks the most frequent
+// pair, every worker merges it in its shard and answers with the count
+// changes, which are summed into the global counts. Ties are broken by the
+// smaller pair, so the merges are those of a single process with the same
+// counts. Workers talk to the coordinator over a Unix socket pair; the same
+// messages could go over TCP to workers on other hosts.
+
+enum ShardCommandType : uint32_t {
+    SHARD_MERGE = 1,
+    SHARD_GET_SEQUENCE = 2,
+    SHARD_EXIT = 3,
+};
+
+struct ShardCommand {
+    uint32_t type = SHARD_EXIT;
+    TokenType a = 0;
+    TokenType b = 0;
+    TokenType L = 0;
+    uint64_t tf = 0;
+};
+
+// answer to the start and to every merge, followed by n_counts pair counts
+struct ShardReport {
+    uint64_t size = 0;
+    ContainerStats stats;
+    uint64_t n_counts = 0;
+};
+
+// false once the other side is gone; MSG_NOSIGNAL keeps a dead worker from
+// killing the coordinator with SIGPIPE
+bool write_all(int fd, const void* data, size_t bytes) {
+    const char* p = static_cast<const char*>(data);
+    while (bytes > 0) {
+        ssize_t written = send(fd, p, bytes, MSG_NOSIGNAL);
+        if (written <= 0) {
+            return false;
+        }
+        p += written;
+        bytes -= written;
+    }
+    return true;
+}
+
+bool read_all(int fd, void* data, size_t bytes) {
+    char* p = static_cast<char*>(data);
+    while (bytes > 0) {
+        ssize_t n_read = read(fd, p, bytes);
+        if (n_read <= 0) {
+            return false;
+        }
+        p += n_read;
+        bytes -= n_read;
+    }
+    return true;
+}
+
+bool send_report(int fd, size_t size, const ContainerStats& stats, const PairCounts& counts) {
+    ShardReport report;
+    report.size = size;
+    report.stats = stats;
+    report.n_counts = counts.size();
+    return write_all(fd, &report, sizeof(report))
+        && write_all(fd, counts.data(), counts.size() * sizeof(PairCounts::value_type));
+}
+
+bool receive_report(int fd, ShardReport& report, PairCounts& counts) {
+    if (!read_all(fd, &report, sizeof(report))) {
+        return false;
+    }
+    counts.resize(report.n_counts);
+    return read_all(fd, counts.data(), counts.size() * sizeof(PairCounts::value_type));
+}
+
+// sums the changes of each pair and drops those that cancel out
+void sum_pair_deltas(PairCounts& deltas) {
+    std::sort(deltas.begin(), deltas.end());
+    size_t w = 0;
+    for (size_t k = 0; k < deltas.size(); k++) {
+        if (w > 0 && deltas[w - 1].first == deltas[k].first) {
+            deltas[w - 1].second += deltas[k].second;
+        } else {
+            deltas[w++] = deltas[k];
+        }
+    }
+    deltas.resize(w);
+    deltas.erase(std::remove_if(deltas.begin(), deltas.end(), [](const PairCounts::value_type& x) { return x.second == 0; }), deltas.end());
+}
+
+// Shard boundaries: shard k starts at cuts[k]. A cut is placed right after a
+// helper token at or past the even split point; without one the shard runs on.
+std::vector<size_t> get_shard_cuts(const std::vector<TokenType>& seq, size_t n_shards) {
+    std::vector<size_t> cuts = {0};
+    size_t n = seq.size();
+    for (size_t k = 1; k < n_shards; k++) {
+        size_t i = std::max(k * n / n_shards, cuts.back() + 2);
+        while (i < n && seq[i - 1] > N_HELP_TOKENS) {
+            i++;
+        }
+        if (i + 2 > n) {
+            break;
+        }
+        cuts.push_back(i);
+    }
+    return cuts;
+}
+
+// Sum of the pair counts of all shards, with a lazy max-heap over it. Ties
+// are broken by the smaller pair.
+class GlobalPairCounts {
+public:
+
+    // adds counts or count changes of one shard
+    void add(const PairCounts& counts) {
+        for (const auto& element : counts) {
+            counts_[element.first] += element.second;
+            touched_.push_back(element.first);
+        }
+    }
+
+    // pairs whose count changed since the last call get a fresh heap entry
+    void push_touched() {
+        std::sort(touched_.begin(), touched_.end());
+        touched_.erase(std::unique(touched_.begin(), touched_.end()), touched_.end());
+        for (uint64_t key : touched_) {
+            auto it = counts_.find(key);
+            if (it->second == 0) {
+                counts_.erase(it);
+            } else if (it->second > 1) {
+                heap_.push(std::make_pair(it->second, key));
+            }
+        }
+        touched_.clear();
+    }
+
+    std::pair<Kmer, size_t> get_most_frequent_pair() {
+        while (!heap_.empty()) {
+            auto top_entry = heap_.top();
+            auto it = counts_.find(top_entry.second);
+            if (it != counts_.end() && it->second == top_entry.first) {
+                return std::make_pair(get_pair_of_key(top_entry.second), top_entry.first);
+            }
+            heap_.pop();
+            stale_heap_pops_++;
+        }
+        return std::make_pair(std::make_tuple(0, 0), 0);
+    }
+
+    size_t stale_heap_pops() const {
+        return stale_heap_pops_;
+    }
+
+private:
+
+    struct CompareCount {
+        bool operator()(const std::pair<int64_t, uint64_t>& a, const std::pair<int64_t, uint64_t>& b) const {
+            if (a.first != b.first) {
+                return a.first < b.first; // larger count first
+            }
+            return a.second > b.second; // then the smaller pair
+        }
+    };
+
+    std::unordered_map<uint64_t, int64_t> counts_;
+    std::priority_queue<std::pair<int64_t, uint64_t>, std::vector<std::pair<int64_t, uint64_t>>, CompareCount> heap_;
+    std::vector<uint64_t> touched_;
+    size_t stale_heap_pops_ = 0;
+};
+
+// sums the counters of the shards
+ContainerStats sum_shard_stats(const std::vector<ContainerStats>& shard_stats) {
+    ContainerStats stats;
+    for (const auto& shard : shard_stats) {
+        stats.positions_visited += shard.positions_visited;
+        stats.positions_live += shard.positions_live;
+        stats.new_kmers += shard.new_kmers;
+        stats.stale_heap_pops += shard.stale_heap_pops;
+    }
+    return stats;
+}
+
+// The loop of a worker process: trains its shard with Engine on the commands
+// of the coordinator and answers each with the count changes.
+template<typename Engine>
+void run_shard_worker(int fd, std::vector<TokenType>& shard, size_t n_threads) {
+    Vocabulary vocab(alphabet);
+    Engine engine(shard, n_threads);
+    PairCounts counts;
+    engine.get_pair_counts(counts);
+    if (!send_report(fd, engine.size(), engine.stats(), counts)) {
+        return;
+    }
+    counts.clear();
+    engine.log_pair_deltas(&counts);
+
+    // a closed connection means the coordinator is gone, the worker just stops
+    ShardCommand command;
+    while (read_all(fd, &command, sizeof(command))) {
+        if (command.type == SHARD_MERGE) {
+            Kmer kmer = std::make_tuple(command.a, command.b);
+            vocab.L = command.L;
+            vocab.add(kmer, command.tf);
+            engine.merge(kmer, command.L, vocab);
+            trim_to_budget();
+            sum_pair_deltas(counts);
+            if (!send_report(fd, engine.size(), engine.stats(), counts)) {
+                break;
+            }
+            counts.clear();
+        } else if (command.type == SHARD_GET_SEQUENCE) {
+            std::vector<TokenType> seq = engine.get_as_vector();
+            uint64_t n = seq.size();
+            if (!write_all(fd, &n, sizeof(n)) || !write_all(fd, seq.data(), n * sizeof(TokenType))) {
+                break;
+            }
+        } else {
+            break;
+        }
+    }
+}
+
+// Engine of the coordinator process, see above. worker_engine is fast or lowmem.
+class ShardedEngine {
+public:
+
+    ShardedEngine(std::vector<TokenType>& seq, size_t n_threads, size_t n_workers, const std::string& worker_engine) {
+        std::vector<size_t> cuts = get_shard_cuts(seq, n_workers);
+        cuts.push_back(seq.size());
+        size_t n_shards = cuts.size() - 1;
+        size_t worker_threads = std::max((size_t)1, n_threads / n_shards);
+        std::cout << "Sharding " << seq.size() << " tokens to " << n_shards << " " << worker_engine << " workers" << std::endl;
+        if (n_shards < n_workers) {
+            std::cout << "Only " << n_shards << " shards: the input has too few record separators or N" << std::endl;
+        }
+        std::cout.flush();
+
+        for (size_t k = 0; k < n_shards; k++) {
+            int fds[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+                std::cerr << "Error: Could not create a socket pair" << std::endl;
+                exit(1);
+            }
+            pid_t pid = fork();
+            if (pid < 0) {
+                std::cerr << "Error: Could not start a worker process" << std::endl;
+                exit(1);
+            }
+            if (pid == 0) {
+                close(fds[0]);
+                for (int fd : worker_fds_) {
+                    close(fd);
+                }
+                std::vector<TokenType> shard(seq.begin() + cuts[k], seq.begin() + cuts[k + 1]);
+                seq.clear(); seq.shrink_to_fit();
+                if (worker_engine == "lowmem") {
+                    run_shard_worker<LowMemEngine>(fds[1], shard, worker_threads);
+                } else {
+                    run_shard_worker<FastEngine>(fds[1], shard, worker_threads);
+                }
+                close(fds[1]);
+                std::cout.flush();
+                _exit(0);
+            }
+            close(fds[1]);
+            worker_fds_.push_back(fds[0]);
+            worker_pids_.push_back(pid);
+        }
+        seq.clear(); seq.shrink_to_fit();
+
+        reports_.resize(n_shards);
+        PairCounts counts;
+        for (size_t k = 0; k < n_shards; k++) {
+            if (!receive_report(worker_fds_[k], reports_[k], counts)) {
+                // the destructor does not run for a half-built engine
+                shutdown_workers();
+                throw_lost_worker(k);
+            }
+            counts_.add(counts);
+        }
+        counts_.push_touched();
+    }
+
+    ~ShardedEngine() {
+        shutdown_workers();
+    }
+
+    std::pair<Kmer, size_t> get_most_frequent_pair() {
+        return counts_.get_most_frequent_pair();
+    }
+
+    // all workers merge at once, their answers are read in order
+    void merge(const Kmer& kmer, TokenType L, Vocabulary& vocab) {
+        ShardCommand command;
+        command.type = SHARD_MERGE;
+        command.a = std::get<0>(kmer);
+        command.b = std::get<1>(kmer);
+        command.L = L;
+        command.tf = vocab.alphabet_tf_map[L];
+        for (size_t k = 0; k < worker_fds_.size(); k++) {
+            if (!write_all(worker_fds_[k], &command, sizeof(command))) {
+                throw_lost_worker(k);
+            }
+        }
+        PairCounts deltas;
+        for (size_t k = 0; k < worker_fds_.size(); k++) {
+            if (!receive_report(worker_fds_[k], reports_[k], deltas)) {
+                throw_lost_worker(k);
+            }
+            counts_.add(deltas);
+        }
+        counts_.push_touched();
+    }
+
+    size_t size() {
+        size_t size = 0;
+        for (const auto& report : reports_) {
+            size += report.size;
+        }
+        return size;
+    }
+
+    // counters of all workers
+    const ContainerStats& stats() {
+        std::vector<ContainerStats> shard_stats;
+        for (const auto& report : reports_) {
+            shard_stats.push_back(report.stats);
+        }
+        stats_ = sum_shard_stats(shard_stats);
+        stats_.stale_heap_pops += counts_.stale_heap_pops();
+        return stats_;
+    }
+
+    // the shards in input order
+    std::vector<TokenType> get_as_vector() {
+        ShardCommand command;
+        command.type = SHARD_GET_SEQUENCE;
+        std::vector<TokenType> seq;
+        seq.reserve(size() + 1);
+        for (size_t k = 0; k < worker_fds_.size(); k++) {
+            int fd = worker_fds_[k];
+            uint64_t n;
+            if (!write_all(fd, &command, sizeof(command)) || !read_all(fd, &n, sizeof(n))) {
+                throw_lost_worker(k);
+            }
+            size_t start = seq.size();
+            seq.resize(start + n);
+            if (!read_all(fd, seq.data() + start, n * sizeof(TokenType))) {
+                throw_lost_worker(k);
+            }
+        }
+        return seq;
+    }
+
+private:
+
+    [[noreturn]] void throw_lost_worker(size_t k) {
+        throw std::runtime_error("Lost the connection to shard worker " + std::to_string(k) + " (pid " + std::to_string(worker_pids_[k]) + ")");
+    }
+
+    // best effort: a worker that is already gone is only reaped
+    void shutdown_workers() {
+        ShardCommand command;
+        command.type = SHARD_EXIT;
+        for (size_t k = 0; k < worker_fds_.size(); k++) {
+            write_all(worker_fds_[k], &command, sizeof(command));
+            close(worker_fds_[k]);
+            waitpid(worker_pids_[k], nullptr, 0);
+        }
+        worker_fds_.clear();
+        worker_pids_.clear();
+    }
+
+    std::vector<int> worker_fds_;
+    std::vector<pid_t> worker_pids_;
+    std::vector<ShardReport> reports_;
+    GlobalPairCounts counts_;
+    ContainerStats stats_;
+};
+
+// CPUs of each NUMA node from sysfs, one empty list where there is no sysfs
+std::vector<std::vector<int>> get_numa_node_cpus() {
+    std::vector<std::vector<int>> nodes;
+    for (size_t node = 0; ; node++) {
+        std::ifstream cpulist_file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        if (!cpulist_file) {
+            break;
+        }
+        // e.g. 0-11,24-35
+        std::vector<int> cpus;
+        std::string range;
+        while (std::getline(cpulist_file, range, ',')) {
+            size_t dash = range.find('-');
+            int first = std::stoi(range.substr(0, dash));
+            int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+            for (int cpu = first; cpu <= last; cpu++) {
+                cpus.push_back(cpu);
+            }
+        }
+        nodes.push_back(cpus);
+    }
+    if (nodes.empty()) {
+        nodes.push_back({});
+    }
+    return nodes;
+}
+
+// binds the calling thread to the given CPUs
+void pin_thread_to_cpus(const std::vector<int>& cpus) {
+    if (cpus.empty()) {
+        return;
+    }
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    for (int cpu : cpus) {
+        CPU_SET(cpu, &cpu_set);
+    }
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+}
+
+// One long-lived thread per shard, bound to the CPUs of a NUMA node in turn.
+// run() hands the same task to every thread and returns when all are done, so
+// a shard is always touched from its own node.
+class ShardThreads {
+public:
+
+    ShardThreads(size_t n_shards) : n_threads_(n_shards) {
+        std::vector<std::vector<int>> nodes = get_numa_node_cpus();
+        nodes_used_ = std::min(nodes.size(), n_shards);
+        for (size_t k = 0; k < n_shards; k++) {
+            // a single node is left to the scheduler
+            std::vector<int> cpus = nodes_used_ > 1 ? nodes[k % nodes.size()] : std::vector<int>();
+            threads_.emplace_back([this, k, cpus]() {
+                pin_thread_to_cpus(cpus);
+                size_t generation = 0;
+                while (true) {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    start_.wait(lock, [&]() { return stop_ || generation_ != generation; });
+                    if (stop_) {
+                        return;
+                    }
+                    generation = generation_;
+                    lock.unlock();
+                    task_(k);
+                    lock.lock();
+                    if (++n_done_ == n_threads_) {
+                        done_.notify_one();
+                    }
+                }
+            });
+        }
+    }
+
+    ~ShardThreads() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        start_.notify_all();
+        for (auto& t : threads_) {
+            t.join();
+        }
+    }
+
+    void run(const std::function<void(size_t)>& task) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        task_ = task;
+        n_done_ = 0;
+        generation_++;
+        start_.notify_all();
+        done_.wait(lock, [&]() { return n_done_ == n_threads_; });
+    }
+
+    size_t nodes_used() const {
+        return nodes_used_;
+    }
+
+private:
+    size_t n_threads_;
+    std::vector<std::thread> threads_;
+    std::mutex mutex_;
+    std::condition_variable start_;
+    std::condition_variable done_;
+    std::function<void(size_t)> task_;
+    size_t generation_ = 0;
+    size_t n_done_ = 0;
+    size_t nodes_used_ = 0;
+    bool stop_ = false;
+};
+
+// In-process sharding: one Engine per shard of records, each allocated,
+// filled and merged by its own thread so that on a multi-socket machine its
+// arrays are first touched on, and stay local to, the node of that thread.
+// Count changes of all shards go into one GlobalPairCounts, so the merges are
+// the same as with worker processes.
+template<typename Engine>
+class LocalShardedEngine {
+public:
+
+    LocalShardedEngine(std::vector<TokenType>& seq, size_t n_threads, size_t n_shards) {
+        std::vector<size_t> cuts = get_shard_cuts(seq, n_shards);
+        cuts.push_back(seq.size());
+        n_shards = cuts.size() - 1;
+        size_t shard_threads = std::max((size_t)1, n_threads / n_shards);
+        threads_ = std::make_unique<ShardThreads>(n_shards);
+        std::cout << "Sharding " << seq.size() << " tokens to " << n_shards << " shards on " << threads_->nodes_used() << " NUMA nodes" << std::endl;
+
+        engines_.resize(n_shards);
+        deltas_.resize(n_shards);
+        threads_->run([&](size_t k) {
+            std::vector<TokenType> shard(seq.begin() + cuts[k], seq.begin() + cuts[k + 1]);
+            engines_[k] = make_quiet_engine(shard, shard_threads);
+            engines_[k]->get_pair_counts(deltas_[k]);
+        });
+        seq.clear(); seq.shrink_to_fit();
+        std::cout << "Shard sizes:";
+        for (auto& engine : engines_) {
+            std::cout << " " << engine->size();
+        }
+        std::cout << std::endl;
+        for (size_t k = 0; k < n_shards; k++) {
+            counts_.add(deltas_[k]);
+            deltas_[k].clear();
+            engines_[k]->log_pair_deltas(&deltas_[k]);
+        }
+        counts_.push_touched();
+    }
+
+    ~LocalShardedEngine() {
+        // engines are freed by their own threads too
+        threads_->run([&](size_t k) {
+            engines_[k].reset();
+        });
+    }
+
+    std::pair<Kmer, size_t> get_most_frequent_pair() {
+        return counts_.get_most_frequent_pair();
+    }
+
+    // the shards merge in parallel, their changes are summed in shard order
+    void merge(const Kmer& kmer, TokenType L, Vocabulary& vocab) {
+        threads_->run([&](size_t k) {
+            engines_[k]->merge(kmer, L, vocab);
+            sum_pair_deltas(deltas_[k]);
+        });
+        for (auto& deltas : deltas_) {
+            counts_.add(deltas);
+            deltas.clear();
+        }
+        counts_.push_touched();
+    }
+
+    size_t size() {
+        size_t size = 0;
+        for (auto& engine : engines_) {
+            size += engine->size();
+        }
+        return size;
+    }
+
+    // counters of all shards
+    const ContainerStats& stats() {
+        std::vector<ContainerStats> shard_stats;
+        for (auto& engine : engines_) {
+            shard_stats.push_back(engine->stats());
+        }
+        stats_ = sum_shard_stats(shard_stats);
+        stats_.stale_heap_pops += counts_.stale_heap_pops();
+        return stats_;
+    }
+
+    // the shards in input order
+    std::vector<TokenType> get_as_vector() {
+        std::vector<TokenType> seq;
+        seq.reserve(size() + engines_.size());
+        for (auto& engine : engines_) {
+            std::vector<TokenType> shard = engine->get_as_vector();
+            seq.insert(seq.end(), shard.begin(), shard.end());
+        }
+        return seq;
+    }
+
+private:
+
+    // the shards run side by side, so their progress output would interleave;
+    // LowMemEngine prints none
+    static std::unique_ptr<Engine> make_quiet_engine(std::vector<TokenType>& shard, size_t n_threads) {
+        if constexpr (std::is_same<Engine, FastEngine>::value) {
+            return std::make_unique<Engine>(shard, n_threads, (size_t)0, nullptr, true);
+        } else {
+            return std::make_unique<Engine>(shard, n_threads);
+        }
+    }
+
+    std::unique_ptr<ShardThreads> threads_;
+    std::vector<std::unique_ptr<Engine>> engines_;
+    std::vector<PairCounts> deltas_;
+    GlobalPairCounts counts_;
+    ContainerStats stats_;
+};
+
+#endif
@@ -0,0 +1,169 @@
+#ifndef STRAND_FILE_H
+#define STRAND_FILE_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <iostream>
+#include <algorithm>
+#include <map>
+
+#include "tokens.hpp"
+#include "trainer.hpp"
+#include "output.hpp"
+#include "shards.hpp"
+
+// reverse complement of each token of the alphabet; helper tokens and N are
+// their own
+std::vector<TokenType> get_alphabet_rc() {
+    std::vector<TokenType> rc;
+    for (TokenType token = 0; token < alphabet.size(); token++) {
+        rc.push_back(token);
+    }
+    rc[alphabet.at("A")] = alphabet.at("T");
+    rc[alphabet.at("T")] = alphabet.at("A");
+    rc[alphabet.at("C")] = alphabet.at("G");
+    rc[alphabet.at("G")] = alphabet.at("C");
+    return rc;
+}
+
+// reverse complement of each token of a strand-canonical vocabulary: the
+// token of the pair (rc(b), rc(a)), which is the token itself for palindromes
+std::vector<TokenType> get_vocab_rc(const Vocabulary& vocab) {
+    std::vector<TokenType> rc = get_alphabet_rc();
+    std::map<Kmer, TokenType> pair_tokens;
+    for (size_t i = 0; i < vocab.merged.size(); i++) {
+        pair_tokens[vocab.merged[i]] = vocab.first_token + i;
+    }
+    rc.resize(vocab.L);
+    for (TokenType token = vocab.first_token; token < vocab.L; token++) {
+        const Kmer& kmer = vocab.merged[token - vocab.first_token];
+        auto it = pair_tokens.find(std::make_tuple(rc[std::get<1>(kmer)], rc[std::get<0>(kmer)]));
+        rc[token] = it == pair_tokens.end() ? token : it->second;
+    }
+    return rc;
+}
+
+// Strand-canonical training on one strand: a pair and its reverse complement
+// (rc(b), rc(a)) are counted together under the smaller of the two keys, which
+// is the count of the pair in the input and its reverse complement together.
+// Each merge of a pair also merges its reverse complement into a second token,
+// so every token comes with its reverse complement token, or is its own when
+// the pair is a palindrome. This gives a strand-symmetric vocabulary at half
+// the memory and time of training on both strands. Ties are broken by the
+// smaller canonical pair.
+//
+// The reverse complement merge is handed to train() as the next most frequent
+// pair, with the count of the first, so that it gets its own log line and
+// metrics. A pair that is not a palindrome is only taken while there is room
+// for both tokens below max_tokens (and MAX_N_TOKENS), otherwise training ends
+// one token short.
+template<typename Engine>
+class StrandCanonicalEngine {
+public:
+
+    template<typename... Args>
+    StrandCanonicalEngine(std::vector<TokenType>& seq, size_t n_threads, size_t max_tokens, Args... engine_args) : max_tokens_(max_tokens) {
+        rc_ = get_alphabet_rc();
+        next_token_ = alphabet.size();
+
+        engine_ = std::make_unique<Engine>(seq, n_threads, engine_args...);
+        engine_->get_pair_counts(deltas_);
+        add_canonical_counts();
+        engine_->log_pair_deltas(&deltas_);
+    }
+
+    std::pair<Kmer, size_t> get_most_frequent_pair() {
+        if (has_pending_rc_) {
+            return std::make_pair(pending_rc_kmer_, pending_rc_tf_);
+        }
+        auto top = counts_.get_most_frequent_pair();
+        bool no_room = (max_tokens_ && next_token_ + 1 > max_tokens_) || next_token_ + 1 >= MAX_N_TOKENS;
+        if (no_room && get_rc_pair(top.first) != top.first) {
+            return std::make_pair(top.first, (size_t)0);
+        }
+        return top;
+    }
+
+    // merges the pair into L and, unless it is a palindrome, leaves its
+    // reverse complement for the next merge, into the token right after L;
+    // the canonical counts are updated once both are merged
+    void merge(const Kmer& kmer, TokenType L, Vocabulary& vocab) {
+        engine_->merge(kmer, L, vocab);
+        next_token_ = L + 1;
+        if (has_pending_rc_) {
+            has_pending_rc_ = false;
+            set_rc(pending_rc_of_, L);
+            set_rc(L, pending_rc_of_);
+        } else {
+            set_rc(L, L);
+            Kmer rc_kmer = get_rc_pair(kmer);
+            if (rc_kmer != kmer) {
+                has_pending_rc_ = true;
+                pending_rc_kmer_ = rc_kmer;
+                pending_rc_tf_ = vocab.alphabet_tf_map.at(L);
+                pending_rc_of_ = L;
+                return;
+            }
+        }
+        sum_pair_deltas(deltas_);
+        add_canonical_counts();
+    }
+
+    size_t size() {
+        return engine_->size();
+    }
+
+    const ContainerStats& stats() {
+        stats_ = engine_->stats();
+        stats_.stale_heap_pops += counts_.stale_heap_pops();
+        return stats_;
+    }
+
+    std::vector<TokenType> get_as_vector() {
+        return engine_->get_as_vector();
+    }
+
+private:
+
+    Kmer get_rc_pair(const Kmer& kmer) const {
+        return std::make_tuple(rc_.at(std::get<1>(kmer)), rc_.at(std::get<0>(kmer)));
+    }
+
+    void set_rc(TokenType token, TokenType rc_token) {
+        if (token >= rc_.size()) {
+            rc_.resize(token + 1, 0);
+        }
+        rc_[token] = rc_token;
+    }
+
+    // moves the counts or count changes in deltas_ to their canonical pairs; a
+    // palindrome occurs on both strands at the same place and counts twice
+    void add_canonical_counts() {
+        for (auto& element : deltas_) {
+            Kmer rc_kmer = get_rc_pair(get_pair_of_key(element.first));
+            uint64_t rc_key = get_pair_key(std::get<0>(rc_kmer), std::get<1>(rc_kmer));
+            if (rc_key == element.first) {
+                element.second *= 2;
+            }
+            element.first = std::min(element.first, rc_key);
+        }
+        counts_.add(deltas_);
+        counts_.push_touched();
+        deltas_.clear();
+    }
+
+    std::unique_ptr<Engine> engine_;
+    std::vector<TokenType> rc_; // reverse complement of each token
+    size_t max_tokens_;
+    TokenType next_token_;
+    bool has_pending_rc_ = false;
+    Kmer pending_rc_kmer_;
+    size_t pending_rc_tf_ = 0;
+    TokenType pending_rc_of_ = 0;
+    PairCounts deltas_;
+    GlobalPairCounts counts_;
+    ContainerStats stats_;
+};
+
+#endif
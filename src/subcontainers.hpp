@@ -14,6 +14,7 @@
 #include <atomic>
 #include <cmath>
 #include <algorithm>
+#include <memory>
 
 #include "tokens.hpp"
 #include "positions.hpp"
@@ -21,6 +22,9 @@
 // typedef CounterType to uint32_t
 typedef uint32_t CounterType;
 
+// default number of kmer ids a CounterContainer has room for
+const size_t COUNTER_DEFAULT_SIZE = 40265318;
+
 class CounterContainer {
 public:
 
@@ -38,15 +42,15 @@ public:
         size_.store(other.size_.load());
         max_size = other.max_size;
 
-        counts = new std::atomic<CounterType>[max_size];
+        counts = allocate_array<std::atomic<CounterType>>(max_size);
         for (size_t i = 0; i < max_size; i++) {
             counts[i].store(other.counts[i].load());
         }
         
-        flags = new char[max_size];
+        flags = allocate_array<char>(max_size);
         memcpy(flags, other.flags, max_size * sizeof(char));
 
-        positions = new PositionsContainer*[max_size];
+        positions = allocate_array<PositionsContainer*>(max_size);
         for (size_t i = 0; i < max_size; i++) {
             if (other.positions[i]) {
                 positions[i] = new PositionsContainer(*other.positions[i]);
@@ -62,23 +66,23 @@ public:
             size_.store(other.size_.load());
             max_size = other.max_size;
 
-            delete[] counts;
-            counts = new std::atomic<CounterType>[max_size];
+            free_array(counts);
+            counts = allocate_array<std::atomic<CounterType>>(max_size);
             for (size_t i = 0; i < max_size; i++) {
                 counts[i].store(other.counts[i].load());
             }
 
-            delete[] flags;
-            flags = new char[max_size];
+            free_array(flags);
+            flags = allocate_array<char>(max_size);
             memcpy(flags, other.flags, max_size * sizeof(char));
 
             if (positions != nullptr) {
                 for (size_t i = 0; i < max_size; i++) {
                     delete positions[i];
                 }
-                delete[] positions;
+                free_array(positions);
             }
-            positions = new PositionsContainer*[max_size];
+            positions = allocate_array<PositionsContainer*>(max_size);
             for (size_t i = 0; i < max_size; i++) {
                 if (other.positions[i]) {
                     positions[i] = new PositionsContainer(*other.positions[i]);
@@ -90,32 +94,43 @@ public:
         return *this;
     }
 
-    CounterContainer(size_t starting_size) {
-        counts = new std::atomic<CounterType>[max_size];
-        for (CounterType i = 0; i < max_size; i++) {
-            counts[i] = 0;
-        }
-        flags = new char[max_size];
-        for (size_t i = 0; i < max_size; i++) {
-            flags[i] = 0;
+    // Move assignment operator, takes the arrays over instead of copying them
+    CounterContainer& operator=(CounterContainer&& other) noexcept {
+        if (this != &other) {
+            std::swap(counts, other.counts);
+            std::swap(flags, other.flags);
+            std::swap(positions, other.positions);
+            std::swap(slab_, other.slab_);
+            u_int64_t size = size_.load();
+            size_.store(other.size_.load());
+            other.size_.store(size);
+            std::swap(max_size, other.max_size);
         }
-        positions = new PositionsContainer*[max_size];
-        for (size_t i = 0; i < max_size; i++) {
-            positions[i] = nullptr;
+        return *this;
+    }
+
+    // arrays come zeroed, file-backed in out-of-core mode; capacity 0 keeps the default
+    CounterContainer(size_t starting_size, size_t capacity = 0) {
+        if (capacity) {
+            max_size = capacity;
         }
+        counts = allocate_array<std::atomic<CounterType>>(max_size);
+        flags = allocate_array<char>(max_size);
+        positions = allocate_array<PositionsContainer*>(max_size);
         size_ = starting_size;
     }
 
     ~CounterContainer() {
-        if (counts != nullptr) delete[] counts;
-        if (flags != nullptr) delete[] flags;
+        free_array(counts);
+        free_array(flags);
         if (positions != nullptr) {
-            for (size_t i = 0; i < max_size; ++i) {
+            // lists exist only for the kmer ids below size_
+            for (size_t i = 0; i < size_; ++i) {
                 if (positions[i] != nullptr) {
                     delete positions[i];
                 }
             }
-            delete[] positions;
+            free_array(positions);
         }
     }
 
@@ -129,7 +144,7 @@ public:
             extend_counts();
         }
         if (positions[kmer_id] == nullptr) {
-            positions[kmer_id] = new PositionsContainer(tf);
+            positions[kmer_id] = new PositionsContainer(tf, slab_.get());
             return;
         }
     }
@@ -142,26 +157,26 @@ public:
         flags[kmer_id] = is_help_token;
     }
 
-    void decrease(size_t kmer_id) {
+    void decrease(size_t kmer_id, CounterType weight = 1) {
         if (kmer_id >= max_size) {
             std::cout << "kmer_id >= max_size" << std::endl;
             exit(1);
         }
         
         if (kmer_id < size_) {
-            counts[kmer_id]--;    
+            counts[kmer_id] -= weight;
             return;
         }
         std::cout << "overflow counter in decrease kmer_id > size_: " << kmer_id << " " << size_ << std::endl;
     }
 
-    void increase(size_t kmer_id) {
+    void increase(size_t kmer_id, CounterType weight = 1) {
         if (kmer_id >= max_size) {
             std::cout << "kmer_id >= max_size" << std::endl;
             exit(1);
         }
         if (kmer_id < size_) {
-            counts[kmer_id]++;
+            counts[kmer_id] += weight;
             return;
         }
         std::cout << "overflow counter in increase kmer_id > size_: " << kmer_id << " " << size_ << std::endl;
@@ -179,6 +194,7 @@ public:
         return false;
     }
 
+    // the buffer of the positions goes back to the slab
     void remove(size_t kmer_id) {
         if (kmer_id >= max_size) {
             std::cout << "kmer_id >= max_size" << std::endl;
@@ -209,6 +225,15 @@ public:
         positions[kmer_id]->set(position);
     }
 
+    // add_position for the threaded init, see PositionsContainer::set_unordered
+    void add_position_unordered(size_t kmer_id, size_t position) {
+        if (kmer_id >= max_size) {
+            std::cout << "kmer_id >= max_size" << std::endl;
+            exit(1);
+        }
+        positions[kmer_id]->set_unordered(position);
+    }
+
     PositionsContainer& get_positions(size_t kmer_id) {
         if (kmer_id >= max_size) {
             std::cout << "kmer_id >= max_size" << std::endl;
@@ -217,6 +242,15 @@ public:
         return *positions[kmer_id];
     }
 
+    // packs the long position lists, once they are filled
+    void pack_positions() {
+        for (size_t i = 0; i < size_; i++) {
+            if (positions[i] != nullptr) {
+                positions[i]->pack();
+            }
+        }
+    }
+
     size_t size() const {
         return size_;
     }
@@ -233,9 +267,9 @@ public:
     void extend_counts() {
         size_t new_size = max_size + increment;
         std::cout << "extend_counts to " << new_size << std::endl;
-        std::atomic<CounterType>* new_counts = new std::atomic<CounterType>[new_size];
-        char* new_flags = new char[new_size];
-        PositionsContainer** new_positions = new PositionsContainer*[new_size];
+        std::atomic<CounterType>* new_counts = allocate_array<std::atomic<CounterType>>(new_size);
+        char* new_flags = allocate_array<char>(new_size);
+        PositionsContainer** new_positions = allocate_array<PositionsContainer*>(new_size);
         for (size_t i = 0; i < max_size; i++) {
             new_flags[i] = flags[i];
             new_positions[i] = positions[i];
@@ -244,17 +278,9 @@ public:
             new_counts[i].store(counts[i].load());
         }
 
-        for (size_t i = max_size; i < new_size; i++) {
-            new_counts[i] = 0;
-            new_flags[i] = 0;
-            new_positions[i] = nullptr;
-        }
-        for (CounterType i = max_size; i < new_size; i++) {
-            new_counts[i] = 0;
-        }
-        delete[] counts;
-        delete[] flags;
-        delete[] positions;
+        free_array(counts);
+        free_array(flags);
+        free_array(positions);
         counts = new_counts;
         flags = new_flags;
         positions = new_positions;
@@ -288,11 +314,103 @@ public:
 private:
     std::atomic<CounterType> * counts;
     PositionsContainer** positions;
+    // buffers of the position lists; behind a pointer, which the lists keep,
+    // so that it moves with them
+    std::unique_ptr<PositionsSlab> slab_ = std::make_unique<PositionsSlab>();
     char* flags;
     std::atomic<u_int64_t> size_ = 0;
-    size_t max_size = 40265318; // 3Gb of space
+    size_t max_size = COUNTER_DEFAULT_SIZE; // 3Gb of space
     const size_t increment = 12653184;
     // size_t max_size = 20; // 3Gb of space
 };
 
-#endif
\ No newline at end of file
+// Kmer ids by pair: an open addressing table over the packed key a << 32 | b
+// with linear probing. Ids are handed out in insertion order and never
+// removed, so the table only grows, doubling at half load. The key is mixed
+// before probing, as pairs of neighbouring token ids would otherwise fill
+// runs of adjacent slots.
+class KmerIndex {
+public:
+
+    static const size_t NOT_FOUND = (size_t)-1;
+
+    KmerIndex(size_t capacity = 1024) {
+        size_t n_slots = 16;
+        while (n_slots < 2 * capacity) {
+            n_slots *= 2;
+        }
+        slots_.assign(n_slots, Slot());
+        mask_ = n_slots - 1;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    // id of the pair or NOT_FOUND; safe to call from many threads while
+    // nothing is inserted
+    size_t find(const Kmer& kmer) const {
+        uint64_t key = get_pair_key(std::get<0>(kmer), std::get<1>(kmer));
+        for (size_t slot = get_slot(key); ; slot = (slot + 1) & mask_) {
+            if (slots_[slot].id == NOT_FOUND || slots_[slot].key == key) {
+                return slots_[slot].id;
+            }
+        }
+    }
+
+    // id of the pair, which is size() before the call if it is new
+    size_t insert(const Kmer& kmer) {
+        uint64_t key = get_pair_key(std::get<0>(kmer), std::get<1>(kmer));
+        size_t slot = get_slot(key);
+        for (; slots_[slot].id != NOT_FOUND; slot = (slot + 1) & mask_) {
+            if (slots_[slot].key == key) {
+                return slots_[slot].id;
+            }
+        }
+        slots_[slot].key = key;
+        slots_[slot].id = size_;
+        if (++size_ * 2 > slots_.size()) {
+            grow();
+        }
+        return size_ - 1;
+    }
+
+private:
+
+    struct Slot {
+        uint64_t key = 0;
+        size_t id = NOT_FOUND;
+    };
+
+    // the finalizer of MurmurHash3
+    size_t get_slot(uint64_t key) const {
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdULL;
+        key ^= key >> 33;
+        key *= 0xc4ceb9fe1a85ec53ULL;
+        key ^= key >> 33;
+        return key & mask_;
+    }
+
+    void grow() {
+        std::vector<Slot> old_slots(2 * slots_.size(), Slot());
+        old_slots.swap(slots_);
+        mask_ = slots_.size() - 1;
+        for (const Slot& old_slot : old_slots) {
+            if (old_slot.id == NOT_FOUND) {
+                continue;
+            }
+            size_t slot = get_slot(old_slot.key);
+            while (slots_[slot].id != NOT_FOUND) {
+                slot = (slot + 1) & mask_;
+            }
+            slots_[slot] = old_slot;
+        }
+    }
+
+    std::vector<Slot> slots_;
+    size_t mask_ = 0;
+    size_t size_ = 0;
+};
+
+#endif
@@ -0,0 +1,51 @@
+#include <iostream>
+#include <string>
+
+#include "options.hpp"
+#include "synthetic.hpp"
+
+int main(int argc, char* argv[]) {
+
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <output_file> [--size n] [--gc f] [--tandem f] [--interspersed f] [--n-runs n] [--n-run-length n] [--mode chromosome|reads] [--chromosomes n] [--read-length n] [--seed n]" << std::endl;
+        return 1;
+    }
+
+    std::string output_file = argv[1];
+    SyntheticParams params;
+    for (int i = 2; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--size") {
+            params.size = std::stoul(get_option_value(argc, argv, i));
+        } else if (arg == "--gc") {
+            params.gc = std::stod(get_option_value(argc, argv, i));
+        } else if (arg == "--tandem") {
+            params.tandem = std::stod(get_option_value(argc, argv, i));
+        } else if (arg == "--interspersed") {
+            params.interspersed = std::stod(get_option_value(argc, argv, i));
+        } else if (arg == "--n-runs") {
+            params.n_runs = std::stoul(get_option_value(argc, argv, i));
+        } else if (arg == "--n-run-length") {
+            params.n_run_length = std::stoul(get_option_value(argc, argv, i));
+        } else if (arg == "--mode") {
+            params.mode = get_option_value(argc, argv, i);
+        } else if (arg == "--chromosomes") {
+            params.chromosomes = std::stoul(get_option_value(argc, argv, i));
+        } else if (arg == "--read-length") {
+            params.read_length = std::stoul(get_option_value(argc, argv, i));
+        } else if (arg == "--seed") {
+            params.seed = std::stoull(get_option_value(argc, argv, i));
+        } else {
+            std::cerr << "Unknown option " << arg << std::endl;
+            return 1;
+        }
+    }
+    if (params.mode != "chromosome" && params.mode != "reads") {
+        std::cerr << "Mode must be either chromosome or reads" << std::endl;
+        return 1;
+    }
+
+    SyntheticGenome genome(params);
+    genome.write(output_file);
+    return 0;
+}
@@ -0,0 +1,208 @@
+#ifndef SYNTHETIC_FILE_H
+#define SYNTHETIC_FILE_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <cstdint>
+#include <algorithm>
+
+// Deterministic generator of genome-like sequences for benchmarks. It uses its
+// own PRNG rather than <random>, whose distributions differ between standard
+// libraries. Fractions and rates are doubles: uniform() builds them from 53
+// bits with exact IEEE arithmetic, so the same parameters give the same bytes
+// on every platform with IEEE doubles.
+
+struct SyntheticParams {
+    size_t size = 1000000;             // total number of bases
+    double gc = 0.41;                  // GC content of the background
+    double tandem = 0.05;              // fraction of bases in tandem repeat arrays
+    double interspersed = 0.10;        // fraction of bases in copies of repeat families
+    size_t n_runs = 10;                // number of N runs
+    size_t n_run_length = 200;         // mean length of an N run
+    std::string mode = "chromosome";   // chromosome (fasta) or reads (one per line)
+    size_t chromosomes = 1;            // chromosome mode: number of fasta records
+    size_t read_length = 150;          // reads mode: length of a read
+    uint64_t seed = 42;
+};
+
+class SplitMix64 {
+public:
+
+    SplitMix64(uint64_t seed) : state_(seed) {}
+
+    uint64_t next() {
+        uint64_t z = (state_ += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+    // uniform integer in [0, n)
+    uint64_t below(uint64_t n) {
+        return n ? next() % n : 0;
+    }
+
+    // uniform in [0, 1) with 53 bits
+    double uniform() {
+        return (next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+private:
+    uint64_t state_;
+};
+
+class SyntheticGenome {
+public:
+
+    SyntheticGenome(const SyntheticParams& params) : params_(params), rng_(params.seed) {
+        // a few repeat families in the style of SINEs and LINE fragments
+        for (size_t i = 0; i < 6; i++) {
+            families_.push_back(background(i < 4 ? 300 : 1000 + rng_.below(2000)));
+        }
+    }
+
+    std::string generate() {
+        std::string genome;
+        genome.reserve(params_.size);
+
+        // segment kinds are drawn with probability fraction / mean length,
+        // so that the base fractions match the parameters
+        const double tandem_mean = 600;
+        const double interspersed_mean = 500;
+        const double background_mean = 2000;
+        double background_fraction = std::max(0.0, 1.0 - params_.tandem - params_.interspersed);
+        double w_tandem = params_.tandem / tandem_mean;
+        double w_interspersed = params_.interspersed / interspersed_mean;
+        double w_background = background_fraction / background_mean;
+        double w_total = w_tandem + w_interspersed + w_background;
+
+        while (genome.size() < params_.size) {
+            double r = rng_.uniform() * w_total;
+            if (r < w_tandem) {
+                genome += tandem_array();
+            } else if (r < w_tandem + w_interspersed) {
+                genome += repeat_copy();
+            } else {
+                genome += background(1 + rng_.below(2 * background_mean));
+            }
+        }
+        genome.resize(params_.size);
+
+        for (size_t i = 0; i < params_.n_runs && genome.size(); i++) {
+            size_t length = 1 + rng_.below(2 * params_.n_run_length);
+            size_t start = rng_.below(genome.size());
+            size_t end = std::min(genome.size(), start + length);
+            std::fill(genome.begin() + start, genome.begin() + end, 'N');
+        }
+        return genome;
+    }
+
+    // chromosome mode writes fasta, reads mode samples reads from both strands
+    void write(const std::string& file_name) {
+        std::string genome = generate();
+        std::ofstream out(file_name);
+        if (!out.is_open()) {
+            std::cerr << "Error: Could not open file " << file_name << std::endl;
+            exit(1);
+        }
+        if (params_.mode == "reads") {
+            size_t n_reads = std::max((size_t)1, params_.size / params_.read_length);
+            size_t read_length = std::min(params_.read_length, genome.size());
+            for (size_t i = 0; i < n_reads; i++) {
+                size_t start = rng_.below(genome.size() - read_length + 1);
+                std::string read = genome.substr(start, read_length);
+                if (rng_.below(2)) {
+                    read = reverse_complement(read);
+                }
+                out << read << "\n";
+            }
+        } else {
+            size_t n = std::max((size_t)1, params_.chromosomes);
+            size_t chunk = (genome.size() + n - 1) / n;
+            for (size_t c = 0; c < n; c++) {
+                out << ">chr" << c + 1 << "\n";
+                size_t end = std::min(genome.size(), (c + 1) * chunk);
+                for (size_t i = c * chunk; i < end; i += 60) {
+                    out << genome.substr(i, std::min((size_t)60, end - i)) << "\n";
+                }
+            }
+        }
+        out.close();
+    }
+
+private:
+
+    char base() {
+        double r = rng_.uniform();
+        if (r < params_.gc / 2) return 'G';
+        if (r < params_.gc) return 'C';
+        if (r < params_.gc + (1 - params_.gc) / 2) return 'A';
+        return 'T';
+    }
+
+    std::string background(size_t length) {
+        std::string s(length, 'A');
+        for (auto& c : s) {
+            c = base();
+        }
+        return s;
+    }
+
+    // substitute a base with the given probability
+    void mutate(std::string& s, double rate) {
+        for (auto& c : s) {
+            if (rng_.uniform() < rate) {
+                c = "ACGT"[rng_.below(4)];
+            }
+        }
+    }
+
+    // homopolymers and microsatellites (period 1-6) or satellites (period 20-200)
+    std::string tandem_array() {
+        size_t period = rng_.below(4) ? 1 + rng_.below(6) : 20 + rng_.below(181);
+        std::string unit = background(period);
+        size_t length = 20 + rng_.below(1200);
+        std::string array;
+        array.reserve(length + period);
+        while (array.size() < length) {
+            array += unit;
+        }
+        array.resize(length);
+        mutate(array, 0.02);
+        return array;
+    }
+
+    // a possibly truncated, diverged copy of a repeat family on either strand
+    std::string repeat_copy() {
+        const std::string& family = families_[rng_.below(families_.size())];
+        size_t start = rng_.below(family.size() / 2);
+        std::string copy = family.substr(start);
+        mutate(copy, 0.10);
+        if (rng_.below(2)) {
+            copy = reverse_complement(copy);
+        }
+        return copy;
+    }
+
+    std::string reverse_complement(const std::string& s) {
+        std::string rc(s.rbegin(), s.rend());
+        for (auto& c : rc) {
+            switch (c) {
+                case 'A': c = 'T'; break;
+                case 'C': c = 'G'; break;
+                case 'G': c = 'C'; break;
+                case 'T': c = 'A'; break;
+                default: break;
+            }
+        }
+        return rc;
+    }
+
+    SyntheticParams params_;
+    SplitMix64 rng_;
+    std::vector<std::string> families_;
+};
+
+#endif
@@ -14,6 +14,7 @@
 #include "core.hpp"
 #include "output.hpp"
 #include "container.hpp"
+#include "trainer.hpp"
 
 
 
@@ -40,7 +41,7 @@ std::vector<TokenType> get_data(std::string& file_name, std::string& format, con
 
 int main(int argc, char* argv[]) {
 
-    if (argc != 6) {
+    if (argc != 7) {
         std::cerr << "Usage: " << argv[0] << " <input_file> <bpe_pos_file> <output_file_prefix> <format: reads, fasta, trf, fastq, bpe> <max_tokens> <threads>" << std::endl;
         return 1;
     }
@@ -51,7 +52,6 @@ int main(int argc, char* argv[]) {
     std::string format = argv[4];
     size_t max_tokens = std::stoul(argv[5]);
     size_t n_threads = std::stoul(argv[6]);
-    std::string n_tokens_suffix = argv[7];
     
     if (max_tokens > MAX_N_TOKENS) {
         std::cout << "Max tokens must be less than 65535" << std::endl;
@@ -61,28 +61,12 @@ int main(int argc, char* argv[]) {
     std::vector<TokenType> seq = get_data(file_name, format, alphabet);
 
     // we keep kmer only in merged, in other places we use kmer_id
-    std::vector<Kmer> merged;
-    std::unordered_map<Kmer, size_t, TupleHash> kmer2kmer_id;
-    std::unordered_map<size_t, Kmer> kmer_id2kmer;
+    KmerIndex kmer2kmer_id;
+    std::vector<Kmer> kmer_id2kmer;
     // set zero for start to mark collapsed nodes
-    kmer2kmer_id[std::make_tuple(0, 0)] = 0;
-    kmer_id2kmer[0] = std::make_tuple(0, 0);
-    TokenType L = alphabet.size();
-
-    std::unordered_map<TokenType, size_t> tokens;
-    std::unordered_map<size_t, TokenType> rev_tokens;
-
-    std::unordered_map<TokenType, size_t> token_to_length;
-
-    std::vector<std::thread> threads;
-
-    std::unordered_map<TokenType, std::string> alphabet_map;
-    std::unordered_map<TokenType, size_t> alphabet_tf_map;
-    // fill with alphabet
-    for (const auto& element : alphabet) {
-        alphabet_map[element.second] = element.first;
-        alphabet_tf_map[element.second] = 0;
-    }
+    kmer2kmer_id.insert(std::make_tuple(0, 0));
+    kmer_id2kmer.push_back(std::make_tuple(0, 0));
+    Vocabulary vocab(alphabet);
 
     // precompute
     auto start_time = std::chrono::high_resolution_clock::now();
@@ -94,8 +78,6 @@ int main(int argc, char* argv[]) {
 
     seq.clear(); seq.resize(0);
 
-    int pos = 0;
-    std::string status;
     size_t rep;
     size_t tf;
     
@@ -106,51 +88,36 @@ int main(int argc, char* argv[]) {
         if (tf < 2) {
             break;
         }
-        if (max_tokens && L > max_tokens) {
+        if (max_tokens && vocab.L > max_tokens) {
             break;
         }
-        if (L >= MAX_N_TOKENS) {
+        if (vocab.L >= MAX_N_TOKENS) {
             break;
         }
         
-        // std::cin >> status;
-        
-        //// Fill resulting structures
         Kmer rep_kmer = kmer_id2kmer.at(rep);
-        merged.push_back(rep_kmer);
-        tokens[L] = rep;
-        rev_tokens[rep] = L;
-        TokenType a = std::get<0>(rep_kmer);
-        TokenType b = std::get<1>(rep_kmer);
-        std::string token_str = alphabet_map.at(a) + alphabet_map.at(b);
-        alphabet_map[L] = token_str;
-        alphabet_tf_map[L] = tf;
-        token_to_length[L] = alphabet_map[L].size();
+        TokenType L = vocab.add(rep_kmer, tf);
 
         if (L < 1000 || (L < 50000 && L % 1000 == 0) || (L < 100000 && L % 10000 == 0) || (L < 1000000 && L % 100000 == 0) || (L < 10000000 && L % 1000000 == 0) || (L < 100000000 && L % 10000000 == 0) || (L % 100000000 == 0)) {
             
             end_time = std::chrono::high_resolution_clock::now();
             auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time).count();
 
-            std::cout << "Tokens " << L << " " << alphabet_map.at(std::get<0>(rep_kmer)) << " " << alphabet_map.at(std::get<1>(rep_kmer)) << " " << token_str << " " << tf << " : "<< "size: " << container.size() << " execution time: " << duration << " milliseconds" << std::endl;
-            pos++;
+            std::cout << "Tokens " << L << " " << vocab.get_string(std::get<0>(rep_kmer)) << " " << vocab.get_string(std::get<1>(rep_kmer)) << " " << vocab.get_string(L) << " " << tf << " : "<< "size: " << container.size() << " execution time: " << duration << " milliseconds" << std::endl;
             start_time = std::chrono::high_resolution_clock::now();
         } 
 
-        container.collapse(rep, L, kmer2kmer_id, kmer_id2kmer, alphabet_map);
-        
-
-        L += 1;
+        container.collapse(rep, L, kmer2kmer_id, kmer_id2kmer);
     }
 
 
     std::vector<TokenType> raw_seq = container.get_as_vector(kmer_id2kmer);
-    save_snapshot(tokens, merged, kmer2kmer_id, rev_tokens, raw_seq, alphabet_map, alphabet_tf_map, output_prefix, std::to_string(L), true);
-    
+    TokenStrings token_strings;
+    vocab.get_strings(token_strings);
+    std::string n_tokens_suffix = std::to_string(vocab.L);
+    save_snapshot(vocab.merged, vocab.first_token, raw_seq, token_strings, vocab.alphabet_tf_map, output_prefix, n_tokens_suffix, true);
     
-    std::string output_bpe_encoding_file = output_prefix + "." + std::to_string(L) + ".bpe";
-    std::string output_bpe_raw_encoding_file = output_prefix + "." + std::to_string(L) + ".raw.bpe";
-    container.save_bpe_to_file(output_bpe_encoding_file, output_bpe_raw_encoding_file, alphabet_map, kmer_id2kmer);
+    save_bpe_from_vector(raw_seq, token_strings, output_prefix + "." + n_tokens_suffix + ".bpe", output_prefix + "." + n_tokens_suffix + ".raw.bpe");
 
     std::cout << "Saving DONE" << std::endl;
     return 0;
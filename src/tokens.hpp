@@ -6,6 +6,12 @@
 #include <functional>
 #include <map>
 #include <numeric>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <unordered_map>
+#include <string_view>
+#include <stdexcept>
 
 const uint N_HELP_TOKENS = 6;
 // const uint MAX_N_TOKENS = 65535;
@@ -16,6 +22,15 @@ typedef std::uint32_t TokenType;
 typedef std::tuple<TokenType, TokenType> Kmer;
 
 
+// a pair packed into one 64-bit key, a << 32 | b
+uint64_t get_pair_key(TokenType a, TokenType b) {
+    return ((uint64_t)a << 32) | b;
+}
+
+Kmer get_pair_of_key(uint64_t key) {
+    return std::make_tuple((TokenType)(key >> 32), (TokenType)(key & 0xffffffff));
+}
+
 namespace std {
     template<>
     struct hash<tuple<TokenType, TokenType>> {
@@ -40,6 +55,58 @@ std::unordered_map<std::string, TokenType> alphabet = {
     {"T", 10}
 };
 
+// Strings of all tokens back to back in one arena, token t is
+// strings[offsets[t]:offsets[t + 1]]. Merged tokens are kept as nodes of the
+// merge tree, their pair and length, and their strings are only materialized
+// here, when an output needs them.
+struct TokenStrings {
+    std::string strings;
+    std::vector<uint64_t> offsets;
+
+    size_t size() const {
+        return offsets.empty() ? 0 : offsets.size() - 1;
+    }
+
+    std::string_view at(uint64_t token) const {
+        if (token >= size()) {
+            throw std::out_of_range("token " + std::to_string(token) + " is not in the vocabulary");
+        }
+        return std::string_view(strings.data() + offsets[token], offsets[token + 1] - offsets[token]);
+    }
+};
+
+// base holds the strings of tokens 0 .. base.size() - 1 and merged[i] is the
+// pair of token base.size() + i; a merged token is copied from the two
+// earlier ones it is made of, so this is one pass over the merges
+void build_token_strings(const std::vector<std::string>& base, const std::vector<Kmer>& merged, TokenStrings& token_strings) {
+    std::vector<uint64_t>& offsets = token_strings.offsets;
+    offsets.assign(1, 0);
+    for (const std::string& s : base) {
+        offsets.push_back(offsets.back() + s.size());
+    }
+    for (const Kmer& kmer : merged) {
+        TokenType a = std::get<0>(kmer);
+        TokenType b = std::get<1>(kmer);
+        if (a >= offsets.size() - 1 || b >= offsets.size() - 1) {
+            throw std::out_of_range("merge of a token that does not exist yet");
+        }
+        offsets.push_back(offsets.back() + (offsets[a + 1] - offsets[a]) + (offsets[b + 1] - offsets[b]));
+    }
+    token_strings.strings.resize(offsets.back());
+    char* strings = &token_strings.strings[0];
+    for (size_t token = 0; token < base.size(); token++) {
+        memcpy(strings + offsets[token], base[token].data(), base[token].size());
+    }
+    for (size_t i = 0; i < merged.size(); i++) {
+        size_t token = base.size() + i;
+        TokenType a = std::get<0>(merged[i]);
+        TokenType b = std::get<1>(merged[i]);
+        uint64_t length_a = offsets[a + 1] - offsets[a];
+        memcpy(strings + offsets[token], strings + offsets[a], length_a);
+        memcpy(strings + offsets[token] + length_a, strings + offsets[b], offsets[b + 1] - offsets[b]);
+    }
+}
+
 template<typename T>
 struct tuple_compare {
     bool operator()(const std::tuple<T, T>& a, const std::tuple<T, T>& b) const {
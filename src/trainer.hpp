@@ -0,0 +1,220 @@
+#ifndef TRAINER_FILE_H
+#define TRAINER_FILE_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <iostream>
+#include <unordered_map>
+
+#include "tokens.hpp"
+#include "container.hpp"
+#include "metrics.hpp"
+#include "mapped.hpp"
+
+// Tokens made by the merge loop. Token ids are assigned in merge order from
+// first_token on, so merged[t - first_token] is the pair of token t. A merged
+// token is a node of the merge tree, its pair and length; its string is only
+// built on demand (get_strings, get_string), so the vocabulary takes memory by
+// the number of merges rather than by the length of the tokens.
+struct Vocabulary {
+    TokenType first_token = 0;
+    TokenType L = 0; // id of the next token
+    std::vector<Kmer> merged;
+    std::vector<std::string> alphabet_strings; // strings of the tokens below first_token
+    // frequency at merge time and length of each token, by token id
+    std::vector<size_t> alphabet_tf_map;
+    std::vector<size_t> token_to_length;
+
+    Vocabulary(const std::unordered_map<std::string, TokenType>& alphabet) {
+        first_token = alphabet.size();
+        L = first_token;
+        alphabet_strings.resize(first_token);
+        alphabet_tf_map.assign(first_token, 0);
+        token_to_length.resize(first_token);
+        for (const auto& element : alphabet) {
+            alphabet_strings[element.second] = element.first;
+            token_to_length[element.second] = element.first.size();
+        }
+    }
+
+    // adds the token of a merged pair and returns its id
+    TokenType add(const Kmer& kmer, size_t tf) {
+        merged.push_back(kmer);
+        alphabet_tf_map.push_back(tf);
+        token_to_length.push_back(token_to_length.at(std::get<0>(kmer)) + token_to_length.at(std::get<1>(kmer)));
+        return L++;
+    }
+
+    // strings of all tokens, for the outputs
+    void get_strings(TokenStrings& token_strings) const {
+        build_token_strings(alphabet_strings, merged, token_strings);
+    }
+
+    // string of one token, spelled out by walking its merge tree
+    std::string get_string(TokenType token) const {
+        std::string token_string;
+        token_string.reserve(token_to_length.at(token));
+        std::vector<TokenType> stack(1, token);
+        while (!stack.empty()) {
+            TokenType top = stack.back();
+            stack.pop_back();
+            if (top < first_token) {
+                token_string += alphabet_strings[top];
+                continue;
+            }
+            const Kmer& kmer = merged[top - first_token];
+            stack.push_back(std::get<1>(kmer));
+            stack.push_back(std::get<0>(kmer));
+        }
+        return token_string;
+    }
+};
+
+// Pair counts or count changes as (a << 32 | b, value), the form in which
+// engines report them for sharded training (shards.hpp).
+typedef std::vector<std::pair<uint64_t, int64_t>> PairCounts;
+
+// SequenceContainer with the kmer id maps it works on. Engines give train()
+// the most frequent pair, merge a pair into a new token and return the
+// encoding at the end.
+class FastEngine {
+public:
+
+    // weights: how many times each token counts, nullptr for once; quiet: no
+    // progress output
+    FastEngine(std::vector<TokenType>& seq, size_t n_threads, size_t positions_capacity = 0, const std::vector<CounterType>* weights = nullptr, bool quiet = false) {
+        // set zero for start to mark collapsed nodes
+        kmer2kmer_id.insert(std::make_tuple(0, 0));
+        kmer_id2kmer.push_back(std::make_tuple(0, 0));
+        container = std::make_unique<SequenceContainer>(seq, kmer2kmer_id, kmer_id2kmer, n_threads, positions_capacity, weights, quiet);
+        seq.clear(); seq.shrink_to_fit();
+    }
+
+    std::pair<Kmer, size_t> get_most_frequent_pair() {
+        size_t rep, tf;
+        std::tie(rep, tf) = container->get_most_frequent_pair();
+        return std::make_pair(kmer_id2kmer.at(rep), tf);
+    }
+
+    // a shard may not have the pair at all
+    void merge(const Kmer& kmer, TokenType L, Vocabulary& vocab) {
+        size_t kmer_id = kmer2kmer_id.find(kmer);
+        if (kmer_id == KmerIndex::NOT_FOUND) {
+            return;
+        }
+        container->collapse(kmer_id, L, kmer2kmer_id, kmer_id2kmer);
+        if (delta_log_ != nullptr) {
+            for (const auto& change : count_log_) {
+                const Kmer& changed = kmer_id2kmer.at(change.first);
+                if (std::get<0>(changed) > N_HELP_TOKENS && std::get<1>(changed) > N_HELP_TOKENS) {
+                    delta_log_->emplace_back(get_pair_key(std::get<0>(changed), std::get<1>(changed)), change.second);
+                }
+            }
+            count_log_.clear();
+        }
+    }
+
+    // counts of all pairs that can be merged
+    void get_pair_counts(PairCounts& counts) {
+        for (size_t kmer_id = 0; kmer_id < kmer_id2kmer.size(); kmer_id++) {
+            TokenType a = std::get<0>(kmer_id2kmer[kmer_id]);
+            TokenType b = std::get<1>(kmer_id2kmer[kmer_id]);
+            size_t count = container->get_count(kmer_id);
+            if (a > N_HELP_TOKENS && b > N_HELP_TOKENS && count > 0) {
+                counts.emplace_back(get_pair_key(a, b), count);
+            }
+        }
+    }
+
+    // merge appends the count changes of mergeable pairs to log, nullptr stops it
+    void log_pair_deltas(PairCounts* log) {
+        delta_log_ = log;
+        container->log_count_changes(log != nullptr ? &count_log_ : nullptr);
+    }
+
+    size_t size() {
+        return container->size();
+    }
+
+    const ContainerStats& stats() const {
+        return container->stats();
+    }
+
+    std::vector<TokenType> get_as_vector() {
+        return container->get_as_vector(kmer_id2kmer);
+    }
+
+private:
+    KmerIndex kmer2kmer_id;
+    std::vector<Kmer> kmer_id2kmer;
+    std::unique_ptr<SequenceContainer> container;
+    std::vector<std::pair<size_t, int>> count_log_;
+    PairCounts* delta_log_ = nullptr;
+};
+
+// The merge loop: merges the most frequent pair until no pair occurs twice or
+// the vocabulary is full.
+template<typename Engine>
+void train(Engine& engine, Vocabulary& vocab, size_t max_tokens, MetricsLog& metrics) {
+
+    auto merge_start_time = std::chrono::high_resolution_clock::now();
+    auto start_time = merge_start_time;
+    Kmer rep_kmer;
+    size_t tf;
+
+    while (true) {
+
+        ContainerStats stats_before = engine.stats();
+        std::tie(rep_kmer, tf) = engine.get_most_frequent_pair();
+
+        if (tf < 2) {
+            break;
+        }
+        if (max_tokens && vocab.L > max_tokens) {
+            break;
+        }
+        if (vocab.L >= MAX_N_TOKENS) {
+            break;
+        }
+
+        TokenType L = vocab.add(rep_kmer, tf);
+        TokenType a = std::get<0>(rep_kmer);
+        TokenType b = std::get<1>(rep_kmer);
+
+        if (L < 1000 || (L < 50000 && L % 1000 == 0) || (L < 100000 && L % 10000 == 0) || (L < 1000000 && L % 100000 == 0) || (L < 10000000 && L % 1000000 == 0) || (L < 100000000 && L % 10000000 == 0) || (L % 100000000 == 0)) {
+
+            auto end_time = std::chrono::high_resolution_clock::now();
+            auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time).count();
+
+            std::cout << "Tokens " << L << " " << vocab.get_string(a) << " " << vocab.get_string(b) << " " << vocab.get_string(L) << " " << tf << " : "<< "size: " << engine.size() << " execution time: " << duration << " milliseconds" << std::endl;
+            start_time = std::chrono::high_resolution_clock::now();
+        }
+
+        auto collapse_start = std::chrono::steady_clock::now();
+        engine.merge(rep_kmer, L, vocab);
+        trim_to_budget();
+        if (metrics.is_open()) {
+            const ContainerStats& stats = engine.stats();
+            MergeMetrics merge;
+            merge.token = L;
+            merge.a = a;
+            merge.b = b;
+            merge.tf = tf;
+            merge.token_length = vocab.token_to_length[L];
+            merge.size = engine.size();
+            merge.positions_visited = stats.positions_visited - stats_before.positions_visited;
+            merge.positions_live = stats.positions_live - stats_before.positions_live;
+            merge.stale_heap_pops = stats.stale_heap_pops - stats_before.stale_heap_pops;
+            merge.new_kmers = stats.new_kmers - stats_before.new_kmers;
+            merge.collapse_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - collapse_start).count();
+            metrics.add(merge);
+        }
+    }
+
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - merge_start_time).count();
+    std::cout << "Merging took " << duration << " ms for " << vocab.merged.size() << " merges" << std::endl;
+}
+
+#endif